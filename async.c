@@ -0,0 +1,239 @@
+/* Asynchronous operations.
+ * An async operation runs its blocking counterpart's code, but with the
+ * requests going through fs->reqa, which returns E2DEVICE_PENDING instead of
+ * waiting for the device. After that, every further request of the attempt
+ * fails without reaching the device, so the attempt unwinds like it would
+ * after an I/O error, dropping everything it held. Once the device calls
+ * ext2_aop_wake, the op gets attempted again, continuing from the last block
+ * (or directory entry) it got.
+ * Only operations that don't modify anything are async, so an attempt that
+ * gives up halfway leaves nothing half done. The one exception is writing back
+ * an inode evicted from the inode cache, which can fail that way already, and
+ * gets retried by the next eviction.
+ *
+ * Which op the thread is running is kept in a thread-specific key, so nothing
+ * between the op and ext2i_reqh needs to know about it. */
+
+#include "ext2.h"
+#include <string.h>
+
+enum {
+	AopRead,
+	AopWalk,
+};
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static void make_key(void);
+static void start(struct ext2 *fs, struct ext2_aop *op, int kind);
+static void run(struct ext2_aop *op);
+static void finish(struct ext2_aop *op);
+static void attempt_read(struct ext2_aop *op);
+static void attempt_walk(struct ext2_aop *op);
+
+static void
+make_key(void)
+{
+	pthread_key_create(&key, NULL);
+}
+
+void
+ext2_setreqa(struct ext2 *fs, e2device_reqa fn)
+{
+	pthread_once(&key_once, make_key);
+	fs->reqa = fn;
+}
+
+/* Only called if fs->reqa is set, so the key exists. */
+struct ext2_aop *
+ext2i_aop_current(void)
+{
+	return pthread_getspecific(key);
+}
+
+void *
+ext2i_reqa(struct ext2 *fs, struct ext2_aop *op, size_t len, size_t off, unsigned hint)
+{
+	void *p;
+	if (op->_internal.pending) return NULL;
+	p = fs->reqa(fs->dev, len, off, hint, op);
+	if (p == E2DEVICE_PENDING) {
+		op->_internal.pending = true;
+		return NULL;
+	}
+	return p;
+}
+
+void
+ext2_read_async(struct ext2 *fs, struct ext2_aop *op, uint32_t inode_n, void *buf, size_t len, size_t off)
+{
+	op->_internal.inode_n = inode_n;
+	op->_internal.buf = buf;
+	op->_internal.len = len;
+	op->_internal.off = off;
+	op->_internal.pos = 0;
+	start(fs, op, AopRead);
+}
+
+void
+ext2c_walk_async(struct ext2 *fs, struct ext2_aop *op, const char *path, size_t plen)
+{
+	op->_internal.inode_n = 2;
+	if (plen < 1 || path[0] != '/') {
+		op->_internal.inode_n = 0;
+		plen = 1;
+	}
+	op->_internal.path = path + 1;
+	op->_internal.len = plen - 1;
+	ext2_diriter(&op->_internal.iter, NULL, 0);
+	start(fs, op, AopWalk);
+}
+
+void
+ext2_aop_wake(struct ext2_aop *op, bool failed)
+{
+#define op_int op->_internal
+	pthread_mutex_lock(&op_int.lock);
+	op_int.failed = failed;
+	if (!op_int.parked) {
+		/* the attempt that got the pending request hasn't returned yet,
+		 * and will deal with it by itself */
+		op_int.woken = true;
+		pthread_mutex_unlock(&op_int.lock);
+		return;
+	}
+	op_int.parked = false;
+	pthread_mutex_unlock(&op_int.lock);
+	if (failed) {
+		finish(op);
+	} else {
+		run(op);
+	}
+#undef op_int
+}
+
+static void
+start(struct ext2 *fs, struct ext2_aop *op, int kind)
+{
+	op->_internal.fs = fs;
+	op->_internal.kind = kind;
+	op->_internal.parked = false;
+	op->_internal.woken = false;
+	op->_internal.failed = false;
+	pthread_mutex_init(&op->_internal.lock, NULL);
+	run(op);
+}
+
+/* Attempts the op until it either completes or has to wait for the device. */
+static void
+run(struct ext2_aop *op)
+{
+#define op_int op->_internal
+	void *prev = op_int.fs->reqa ? pthread_getspecific(key) : NULL;
+	for (;;) {
+		op_int.pending = false;
+		if (op_int.fs->reqa) pthread_setspecific(key, op);
+		if (op_int.kind == AopRead) {
+			attempt_read(op);
+		} else {
+			attempt_walk(op);
+		}
+		if (op_int.fs->reqa) pthread_setspecific(key, prev);
+		if (!op_int.pending) break;
+
+		pthread_mutex_lock(&op_int.lock);
+		if (!op_int.woken) {
+			/* the op belongs to whoever calls ext2_aop_wake now */
+			op_int.parked = true;
+			pthread_mutex_unlock(&op_int.lock);
+			return;
+		}
+		op_int.woken = false;
+		pthread_mutex_unlock(&op_int.lock);
+		if (op_int.failed) break;
+	}
+	finish(op);
+#undef op_int
+}
+
+static void
+finish(struct ext2_aop *op)
+{
+#define op_int op->_internal
+	struct ext2 *fs = op_int.fs;
+	if (op_int.kind == AopRead) {
+		/* outside of any attempt, so it may wait for the device */
+		if (op_int.pos > 0) {
+			pthread_rwlock_rdlock(ext2i_inode_lock(fs, op_int.inode_n));
+			ext2i_touch(fs, op_int.inode_n, Ext2TouchA);
+			pthread_rwlock_unlock(ext2i_inode_lock(fs, op_int.inode_n));
+		}
+		op->ret = op_int.pos;
+	} else {
+		/* a failed lookup didn't find anything */
+		op->ret = op_int.failed ? 0 : op_int.inode_n;
+	}
+	pthread_mutex_destroy(&op_int.lock);
+	/* might free the op */
+	op->done(op);
+#undef op_int
+}
+
+/* ext2_read, starting at pos */
+static void
+attempt_read(struct ext2_aop *op)
+{
+#define op_int op->_internal
+	struct ext2 *fs = op_int.fs;
+	pthread_rwlock_rdlock(ext2i_inode_lock(fs, op_int.inode_n));
+	while (op_int.pos < op_int.len) {
+		size_t part_len = op_int.len - op_int.pos;
+		unsigned hint = part_len > fs->block_size ? E2HintSeq : 0;
+		void *p = ext2i_req_file(fs, Ext2SiteFile, hint, op_int.inode_n, &part_len, op_int.off + op_int.pos);
+		if (!p) {
+			break;
+		}
+		memcpy((char*)op_int.buf + op_int.pos, p, part_len);
+		ext2_dropreq(fs, p, false);
+		op_int.pos += part_len;
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, op_int.inode_n));
+#undef op_int
+}
+
+/* ext2c_walk, starting at the directory inode_n with path left to look up */
+static void
+attempt_walk(struct ext2_aop *op)
+{
+#define op_int op->_internal
+	struct ext2 *fs = op_int.fs;
+	while (op_int.len > 0 && op_int.inode_n != 0) {
+		const char *slash = memchr(op_int.path, '/', op_int.len);
+		size_t seglen = slash ? (size_t)(slash - op_int.path) : op_int.len;
+		uint32_t found = 0;
+
+		/* An iterator that ran into a failed request only advanced past the
+		 * entries it returned, so it can continue where it stopped. */
+		op_int.iter._internal.needs_reset = false;
+		while (found == 0 && ext2_diriter(&op_int.iter, fs, op_int.inode_n)) {
+			if (op_int.iter.ent->namelen_lower == seglen &&
+				memcmp(op_int.iter.ent->name, op_int.path, seglen) == 0)
+			{
+				found = op_int.iter.ent->inode;
+			}
+		}
+		if (found == 0) {
+			if (!op_int.pending) {
+				op_int.inode_n = 0;
+			}
+			return;
+		}
+		if (seglen < op_int.len) seglen++;
+		op_int.path += seglen;
+		op_int.len -= seglen;
+		op_int.inode_n = found;
+		ext2_diriter(&op_int.iter, NULL, 0);
+	}
+#undef op_int
+}
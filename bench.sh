@@ -0,0 +1,47 @@
+#!/bin/sh
+# Builds synthetic images with mkfs.ext2 and e2build, and runs e2bench on
+# each of them. Used by `make bench`, the results are tab-separated.
+#   BENCH_DIR   scratch directory, removed afterwards
+#   BENCH_MB    image size
+#   BENCH_FLAGS passed to e2bench, e.g. -t
+set -e
+
+dir=${BENCH_DIR:-bench.tmp}
+mb=${BENCH_MB:-128}
+
+rm -rf "$dir"
+mkdir -p "$dir/tree/bench/wide" "$dir/tree/bench/churn"
+trap 'rm -rf "$dir"' EXIT
+
+# the tree e2bench expects
+deep="$dir/tree/bench/deep"
+i=0
+while [ $i -lt 32 ]; do
+	deep="$deep/d"
+	i=$((i + 1))
+done
+mkdir -p "$deep"
+i=0
+while [ $i -lt 1000 ]; do
+	echo $i > "$dir/tree/bench/wide/f$i"
+	i=$((i + 1))
+done
+dd if=/dev/urandom of="$dir/tree/bench/big" bs=1048576 count=8 2>/dev/null
+
+printf 'block_size\tgroups\tfill\tbench\tops\tseconds\tops_per_s\treqs_per_op\tbytes_per_op\trereqs_per_op\n'
+# block size, blocks per group
+for cfg in "1024 8192" "4096 32768" "4096 8192"; do
+	set -- $cfg
+	for fill in 0 50 90; do
+		# fill up the image, minus some space for the benchmarks themselves
+		filler=$((mb * fill / 100 - 16))
+		rm -f "$dir/tree/filler"
+		if [ $filler -gt 0 ]; then
+			dd if=/dev/zero of="$dir/tree/filler" bs=1048576 count=$filler 2>/dev/null
+		fi
+		rm -f "$dir/img.e2"
+		mkfs.ext2 -q -b $1 -g $2 "$dir/img.e2" $((mb * 1024 / ($1 / 1024))) >/dev/null 2>&1
+		./e2build "$dir/img.e2" "$dir/tree" >/dev/null 2>&1
+		./e2bench $BENCH_FLAGS "$dir/img.e2" $fill
+	done
+done
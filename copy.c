@@ -0,0 +1,203 @@
+/* Copying between files within the filesystem.
+ * The destination gets allocated a source extent at a time, as contiguous as
+ * free space allows, and the data never passes through the caller. Holes in
+ * the source stay holes, unless the destination already has blocks there.
+ * Runs that are physically contiguous in both files get handed to the device's
+ * copy function whole, if it has one (see ext2_setcopy). Otherwise they get
+ * copied a block at a time through a bounce buffer, as only one request may
+ * be active. */
+
+#include "ext2.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int copy_locked(struct ext2 *fs, uint32_t src_n, size_t src_off, uint32_t dst_n, size_t dst_off, size_t len);
+static int extent(struct ext2 *fs, uint32_t inode_n, size_t pos, size_t *dev_off, size_t *dev_len);
+static int bounce(struct ext2 *fs, char *buf, uint32_t src_n, size_t src_dev, uint32_t dst_n, size_t dst_dev, size_t len);
+
+void
+ext2_setcopy(struct ext2 *fs, e2device_copy fn)
+{
+	fs->copy = fn;
+}
+
+int
+ext2_copy_range(struct ext2 *fs, uint32_t src_n, size_t src_off, uint32_t dst_n, size_t dst_off, size_t len)
+{
+	pthread_rwlock_t *src_lock = ext2i_inode_lock(fs, src_n);
+	pthread_rwlock_t *dst_lock = ext2i_inode_lock(fs, dst_n);
+	int ret;
+	if (!fs->rw) return -1;
+	if (src_n == dst_n && src_off < dst_off + len && dst_off < src_off + len) return -1;
+	if ((uint32_t)(dst_off + len) != dst_off + len) return -1;
+
+	/* both inodes, in the order of their locks */
+	if (src_lock == dst_lock) {
+		pthread_rwlock_wrlock(dst_lock);
+	} else if (src_lock < dst_lock) {
+		pthread_rwlock_rdlock(src_lock);
+		pthread_rwlock_wrlock(dst_lock);
+	} else {
+		pthread_rwlock_wrlock(dst_lock);
+		pthread_rwlock_rdlock(src_lock);
+	}
+	ret = copy_locked(fs, src_n, src_off, dst_n, dst_off, len);
+	if (ret > 0) {
+		ext2i_touch(fs, dst_n, Ext2TouchM | Ext2TouchC);
+		ext2i_touch(fs, src_n, Ext2TouchA);
+	}
+	if (src_lock != dst_lock) {
+		pthread_rwlock_unlock(src_lock);
+	}
+	pthread_rwlock_unlock(dst_lock);
+	return ret;
+}
+
+static int
+copy_locked(struct ext2 *fs, uint32_t src_n, size_t src_off, uint32_t dst_n, size_t dst_off, size_t len)
+{
+	struct ext2d_inode *inode;
+	size_t src_size, dst_size, dst_size_up;
+	char *buf = NULL;
+	int ret = -1;
+
+	inode = ext2_req_inode(fs, src_n);
+	if (!inode) return -1;
+	src_size = inode->size_lower;
+	ext2_dropreq(fs, inode, false);
+	if (src_off >= src_size) return 0;
+	if (len > src_size - src_off) {
+		len = src_size - src_off;
+	}
+	/* the return value has to fit */
+	if (len > INT_MAX) {
+		len = INT_MAX;
+	}
+
+	inode = ext2_req_inode(fs, dst_n);
+	if (!inode) return -1;
+	dst_size = inode->size_lower;
+	ext2_dropreq(fs, inode, false);
+	dst_size_up = (dst_size + fs->block_mask) & ~(size_t)fs->block_mask;
+
+	/* A piece at a time, each either data or a hole in the source, and
+	 * either within the destination's blocks or past them. */
+	for (size_t pos = 0; pos < len; ) {
+		size_t src_dev = 0, n, at = dst_off + pos;
+		int hole = extent(fs, src_n, src_off + pos, &src_dev, &n);
+		if (hole < 0) goto fail;
+		if (n > len - pos) {
+			n = len - pos;
+		}
+		if (at < dst_size_up && at + n > dst_size_up) {
+			n = dst_size_up - at;
+		}
+		/* Source holes stay holes. Blocks within the destination's size get
+		 * zeroed when allocated, so a failed copy can't expose old data
+		 * there. Past it, nothing can read them until the size is set. */
+		if (!hole && ext2i_alloc_range(fs, dst_n, at, at + n,
+				(at >= dst_size_up ? Ext2AllocFill : 0)
+				| (at + n > dst_size ? Ext2AllocAppend : 0)) < 0) {
+			goto fail;
+		}
+		for (size_t done = 0; done < n; ) {
+			size_t dst_dev = 0, m;
+			int dst_hole = extent(fs, dst_n, at + done, &dst_dev, &m);
+			if (dst_hole < 0 || (dst_hole && !hole)) goto fail;
+			if (m > n - done) {
+				m = n - done;
+			}
+			if (dst_hole) {
+				/* a hole copied onto a hole */
+			} else if (!hole && fs->copy && !fs->trace.fn) {
+				/* The copy function bypasses the requests, so it can't
+				 * be traced. */
+				if (fs->copy(fs->dev, dst_dev, src_dev + done, m) < 0) goto fail;
+			} else {
+				if (!buf && !(buf = malloc(fs->block_size))) goto fail;
+				/* blocks the destination already had get zeroed */
+				if (bounce(fs, hole ? NULL : buf, src_n, src_dev + done, dst_n, dst_dev, m) < 0) goto fail;
+			}
+			done += m;
+		}
+		pos += n;
+	}
+
+	if (dst_size < dst_off + len) {
+		inode = ext2_req_inode(fs, dst_n);
+		if (!inode) goto fail;
+		if (inode->size_lower < dst_off + len) {
+			inode->size_lower = dst_off + len;
+		}
+		if (ext2_dropreq(fs, inode, true) < 0) goto fail;
+	}
+	ret = len;
+	goto out;
+fail:
+	/* the blocks past the old size weren't zeroed */
+	if (dst_size < dst_off + len) {
+		ext2i_truncate(fs, dst_n, dst_size);
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+/* ext2_inode_ondisk, but extended over the following blocks as long as they're
+ * physically contiguous (or holes, if it starts with one), within a single
+ * request of the block map. */
+static int
+extent(struct ext2 *fs, uint32_t inode_n, size_t pos, size_t *dev_off, size_t *dev_len)
+{
+	uint32_t *blocks;
+	size_t blocks_len, n;
+	uint32_t first;
+	blocks = ext2_req_blockmap(fs, inode_n, &blocks_len, pos >> fs->block_shift, false);
+	if (!blocks) return -1;
+	first = blocks[0];
+	for (n = 1; n < blocks_len && blocks[n] == (first ? first + n : 0); n++);
+	ext2_dropreq(fs, blocks, false);
+	*dev_len = ((uint64_t)n << fs->block_shift) - (pos & fs->block_mask);
+	if (first == 0) return 1;
+	*dev_off = ((uint64_t)first << fs->block_shift) + (pos & fs->block_mask);
+	return 0;
+}
+
+/* Copies len bytes a block at a time, or writes zeroes if buf is NULL. The
+ * pieces end at the block boundaries of both sides, which only differ if the
+ * offsets within the files aren't equally aligned. */
+static int
+bounce(struct ext2 *fs, char *buf, uint32_t src_n, size_t src_dev, uint32_t dst_n, size_t dst_dev, size_t len)
+{
+	for (size_t pos = 0; pos < len; ) {
+		size_t n = fs->block_size - ((dst_dev + pos) & fs->block_mask);
+		unsigned hint;
+		void *p;
+		if (buf && n > fs->block_size - ((src_dev + pos) & fs->block_mask)) {
+			n = fs->block_size - ((src_dev + pos) & fs->block_mask);
+		}
+		if (n > len - pos) {
+			n = len - pos;
+		}
+		hint = pos + n < len ? E2HintSeq : 0;
+		if (buf) {
+			p = ext2i_reqh(fs, Ext2SiteFile, hint, src_n, n, src_dev + pos);
+			if (!p) return -1;
+			memcpy(buf, p, n);
+			ext2_dropreq(fs, p, false);
+		}
+		p = ext2i_reqh(fs, Ext2SiteFile, hint, dst_n, n, dst_dev + pos);
+		if (!p) return -1;
+		if (buf) {
+			memcpy(p, buf, n);
+		} else {
+			memset(p, 0, n);
+		}
+		if (ext2i_drop(fs, p, true) < 0) {
+			return -1;
+		}
+		pos += n;
+	}
+	return 0;
+}
@@ -0,0 +1,298 @@
+/* Compares the async operations with the blocking ones. Not part of the
+ * library.
+ *   ./e2aread [-n ops] [-l latency_us] [-j loaders] [-c chunk] [-m pool_kib]
+ *             image path
+ *
+ * Every op looks up path and reads a random 64KiB piece of the file, ROUNDS
+ * times. First the ops run one after another with ext2c_walk and ext2_read,
+ * then all of them at once with ext2c_walk_async and ext2_read_async, on top
+ * of ex_shcache's loader threads. The device sleeps for latency_us on every
+ * read, like a remote one would, so the blocking run waits for every miss,
+ * while the async one overlaps them. Both runs read the same pieces, starting
+ * with an empty pool of 16 shards, and every piece is compared with a copy of
+ * the file read beforehand. The defaults (64 ops, 1ms, 4 loaders, 4KiB chunks
+ * in a 1MiB pool) keep the pool much smaller than a file of a few MB, so most
+ * reads miss.
+ * Prints a tab-separated line per run:
+ *   mode ops seconds ops_per_s */
+
+#include "ex_shcache.h"
+#include "ext2.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+#define ROUNDS 8
+#define LEN 65536 /* per read */
+#define USAGE "usage: ./e2aread [-n ops] [-l latency_us] [-j loaders] [-c chunk] [-m pool_kib] image path"
+
+struct disk {
+	int fd;
+	long latency; /* in microseconds */
+};
+
+struct job {
+	struct ext2_aop op; /* first, so the op is the job */
+	struct run *run;
+	size_t *offs; /* ROUNDS of them */
+	int round;
+	char buf[LEN];
+};
+
+struct run {
+	struct ext2 *fs;
+	const char *path;
+	const char *ref;
+	unsigned long bad;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int left; /* jobs */
+};
+
+static int my_read(void *userdata, void *buf, size_t len, size_t off);
+static int my_write(void *userdata, const void *buf, size_t len, size_t off);
+static double now(void);
+static void check(struct job *j, size_t got);
+static void start_walk(struct job *j);
+static void walk_done(struct ext2_aop *op);
+static void read_done(struct ext2_aop *op);
+static double run_sync(struct run *r, struct job *jobs, int ops);
+static double run_async(struct run *r, struct job *jobs, int ops);
+
+static int
+my_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	struct disk *d = userdata;
+	if (d->latency > 0) {
+		struct timespec ts = {d->latency / 1000000, d->latency % 1000000 * 1000};
+		nanosleep(&ts, NULL);
+	}
+	if (pread(d->fd, buf, len, off) == (ssize_t)len) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static int
+my_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	(void)userdata; (void)buf; (void)len; (void)off;
+	return -1; /* nothing gets written */
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+check(struct job *j, size_t got)
+{
+	size_t off = j->offs[j->round];
+	if (got != LEN || memcmp(j->buf, j->run->ref + off, LEN) != 0) {
+		__atomic_fetch_add(&j->run->bad, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* The callbacks run on whichever thread finished the op, which may also be the
+ * one starting it. */
+static void
+start_walk(struct job *j)
+{
+	j->op.done = walk_done;
+	ext2c_walk_async(j->run->fs, &j->op, j->run->path, strlen(j->run->path));
+}
+
+static void
+walk_done(struct ext2_aop *op)
+{
+	struct job *j = (struct job*)op;
+	if (op->ret == 0) {
+		/* counts as a failed read */
+		read_done(op);
+		return;
+	}
+	j->op.done = read_done;
+	ext2_read_async(j->run->fs, &j->op, op->ret, j->buf, LEN, j->offs[j->round]);
+}
+
+static void
+read_done(struct ext2_aop *op)
+{
+	struct job *j = (struct job*)op;
+	struct run *r = j->run;
+	check(j, op->ret);
+	if (++j->round < ROUNDS) {
+		start_walk(j);
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	if (--r->left == 0) {
+		pthread_cond_signal(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+static double
+run_sync(struct run *r, struct job *jobs, int ops)
+{
+	double start = now();
+	for (int i = 0; i < ops; i++) {
+		struct job *j = &jobs[i];
+		for (j->round = 0; j->round < ROUNDS; j->round++) {
+			uint32_t inode_n = ext2c_walk(r->fs, r->path, strlen(r->path));
+			size_t got = 0;
+			if (inode_n != 0) {
+				got = ext2_read(r->fs, inode_n, j->buf, LEN, j->offs[j->round]);
+			}
+			check(j, got);
+		}
+	}
+	return now() - start;
+}
+
+static double
+run_async(struct run *r, struct job *jobs, int ops)
+{
+	double start = now();
+	r->left = ops;
+	for (int i = 0; i < ops; i++) {
+		jobs[i].round = 0;
+		start_walk(&jobs[i]);
+	}
+	pthread_mutex_lock(&r->lock);
+	while (r->left > 0) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return now() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ops = 64, loaders = 4, opt;
+	size_t chunk = 4096, pool_kib = 1024;
+	struct disk disk = {0};
+	struct run r = {0};
+	struct job *jobs;
+	size_t *offs;
+	size_t size;
+	char *ref;
+	unsigned seed = 1;
+
+	disk.latency = 1000;
+	while ((opt = getopt(argc, argv, "n:l:j:c:m:")) != -1) {
+		switch (opt) {
+		case 'n': ops = atoi(optarg); break;
+		case 'l': disk.latency = atol(optarg); break;
+		case 'j': loaders = atoi(optarg); break;
+		case 'c': chunk = strtoul(optarg, NULL, 0); break;
+		case 'm': pool_kib = strtoul(optarg, NULL, 0); break;
+		default: errx(1, USAGE);
+		}
+	}
+	if (argc - optind != 2 || ops < 1 || loaders < 1) {
+		errx(1, USAGE);
+	}
+	r.path = argv[optind + 1];
+	disk.fd = open(argv[optind], O_RDONLY);
+	if (disk.fd < 0) errx(1, "couldn't open %s", argv[optind]);
+
+	/* the reference copy, read without the latency */
+	{
+		long latency = disk.latency;
+		struct e2device *dev;
+		struct ext2 *fs;
+		struct ext2d_inode *inode;
+		uint32_t inode_n;
+		disk.latency = 0;
+		dev = exs_init(my_read, my_write, &disk, 1, 1 << 20, chunk);
+		if (!dev) errx(1, "exs_init failed");
+		fs = ext2_opendev(dev, exs_req, exs_drop);
+		if (!fs) errx(1, "ext2_opendev failed");
+		ext2_setro(fs);
+		inode_n = ext2c_walk(fs, r.path, strlen(r.path));
+		if (inode_n == 0) errx(1, "%s not found", r.path);
+		inode = ext2_req_inode(fs, inode_n);
+		if (!inode) errx(1, "couldn't read the inode");
+		size = inode->size_lower;
+		ext2_dropreq(fs, inode, false);
+		if (size < LEN) errx(1, "%s is smaller than %d bytes", r.path, LEN);
+		ref = malloc(size);
+		if (!ref) errx(1, "out of memory");
+		if ((size_t)ext2_read(fs, inode_n, ref, size, 0) != size) {
+			errx(1, "couldn't read %s", r.path);
+		}
+		ext2_free(fs);
+		exs_free(dev);
+		disk.latency = latency;
+	}
+	r.ref = ref;
+
+	jobs = calloc(ops, sizeof *jobs);
+	offs = malloc((size_t)ops * ROUNDS * sizeof *offs);
+	if (!jobs || !offs) errx(1, "out of memory");
+	for (int i = 0; i < ops; i++) {
+		jobs[i].run = &r;
+		jobs[i].offs = &offs[(size_t)i * ROUNDS];
+		for (int k = 0; k < ROUNDS; k++) {
+			jobs[i].offs[k] = (size_t)rand_r(&seed) % (size - LEN + 1);
+		}
+	}
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+
+	printf("mode\tops\tseconds\tops_per_s\n");
+	for (int async = 0; async < 2; async++) {
+		struct exs_pool *pool = exs_pool_init(16, pool_kib * 1024 / 16, chunk);
+		struct e2device *dev;
+		double secs;
+		if (!pool) errx(1, "exs_pool_init failed, is the chunk a power of 2?");
+		if (async && exs_pool_loaders(pool, loaders, ext2_aop_wake) < 0) {
+			errx(1, "couldn't start the loaders");
+		}
+		dev = exs_attach(pool, my_read, my_write, &disk);
+		if (!dev) errx(1, "exs_attach failed");
+		r.fs = ext2_opendev(dev, exs_req, exs_drop);
+		if (!r.fs) errx(1, "ext2_opendev failed");
+		ext2_setro(r.fs);
+		ext2_setreqh(r.fs, exs_reqh);
+		if (async) {
+			ext2_setreqa(r.fs, exs_reqa);
+			secs = run_async(&r, jobs, ops);
+		} else {
+			secs = run_sync(&r, jobs, ops);
+		}
+		printf("%s\t%d\t%f\t%.1f\n", async ? "async" : "sync", ops * ROUNDS,
+				secs, ops * ROUNDS / secs);
+		ext2_free(r.fs);
+		exs_free(dev);
+		exs_pool_free(pool);
+	}
+
+	if (r.bad > 0) {
+		printf("%lu reads returned the wrong data\n", r.bad);
+	}
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+	free(jobs);
+	free(offs);
+	free(ref);
+	close(disk.fd);
+	return r.bad ? 1 : 0;
+}
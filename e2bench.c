@@ -0,0 +1,389 @@
+/* Microbenchmarks for the library. Not part of the library, see bench.sh for
+ * how the images get prepared.
+ *
+ * The device is uncached and counts every request, so the requests and bytes
+ * per operation show what the library itself asks for. Every benchmark prints
+ * a single tab-separated line:
+ *   block_size groups fill bench ops seconds ops_per_s reqs_per_op bytes_per_op rereqs_per_op
+ * With -t, the requests are traced, and every benchmark is followed by a line
+ * per request site, named bench.site. A re-request is a request for the same
+ * area as the previous one from the same site, usually a sign of a missing
+ * cache. Without -t, rereqs_per_op is "-".
+ * The image gets modified, and some blocks get leaked by alloc_block. */
+
+#include "ext2.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+#define DEPTH 32 /* of /bench/deep/d/d/... */
+#define WIDE 1000 /* files in /bench/wide */
+
+struct e2device {
+	int fd;
+	unsigned long reqs;
+	unsigned long long bytes;
+};
+
+struct sitestat {
+	unsigned long reqs, rereqs;
+	unsigned long long bytes;
+	size_t last_off, last_len;
+};
+
+struct bench {
+	struct ext2 *fs;
+	struct e2device *dev;
+	const char *fill;
+	uint64_t rng;
+	bool trace;
+	/* for the current benchmark */
+	struct timespec start;
+	unsigned long reqs;
+	unsigned long long bytes;
+	struct sitestat sites[Ext2SiteCount];
+};
+
+static const char *site_names[Ext2SiteCount] = {
+	[Ext2SiteSb] = "sb",
+	[Ext2SiteBgdt] = "bgdt",
+	[Ext2SiteBitmap] = "bitmap",
+	[Ext2SiteInode] = "inode",
+	[Ext2SiteBlockmap] = "blockmap",
+	[Ext2SiteFile] = "file",
+	[Ext2SiteDirent] = "dirent",
+	[Ext2SiteAlloc] = "alloc",
+};
+
+static void *cnt_req(struct e2device *dev, size_t len, size_t off);
+static int cnt_drop(struct e2device *dev, void *ptr, bool dirty);
+static void tracer(void *userdata, const struct ext2_trace *t);
+static uint64_t rnd(struct bench *b);
+static uint32_t walk(struct bench *b, const char *path);
+static void begin(struct bench *b);
+static void end(struct bench *b, const char *name, unsigned long ops);
+static void bench_read_seq(struct bench *b);
+static void bench_read_rand(struct bench *b);
+static void bench_walk_deep(struct bench *b);
+static void bench_walk_wide(struct bench *b);
+static void bench_diriter(struct bench *b);
+static uint32_t bench_write_append(struct bench *b);
+static void bench_link_churn(struct bench *b, uint32_t target);
+static void bench_alloc_block(struct bench *b);
+
+/* The request header lives right before the returned pointer. */
+struct reqhdr {
+	size_t len, off;
+} __attribute__((aligned(16)));
+
+static void *
+cnt_req(struct e2device *dev, size_t len, size_t off)
+{
+	struct reqhdr *h = malloc(sizeof *h + len);
+	if (!h) return NULL;
+	if (pread(dev->fd, h + 1, len, off) != (ssize_t)len) {
+		free(h);
+		return NULL;
+	}
+	h->len = len;
+	h->off = off;
+	dev->reqs++;
+	dev->bytes += len;
+	return h + 1;
+}
+
+static int
+cnt_drop(struct e2device *dev, void *ptr, bool dirty)
+{
+	struct reqhdr *h = (struct reqhdr*)ptr - 1;
+	int ret = 0;
+	if (dirty) {
+		if (pwrite(dev->fd, ptr, h->len, h->off) != (ssize_t)h->len) {
+			ret = -1;
+		}
+		dev->bytes += h->len;
+	}
+	free(h);
+	return ret;
+}
+
+static void
+tracer(void *userdata, const struct ext2_trace *t)
+{
+	struct bench *b = userdata;
+	struct sitestat *st = &b->sites[t->site];
+	if (t->drop) {
+		if (t->dirty) st->bytes += t->len;
+		return;
+	}
+	if (st->reqs > 0 && st->last_off == t->off && st->last_len == t->len) {
+		st->rereqs++;
+	}
+	st->reqs++;
+	st->bytes += t->len;
+	st->last_off = t->off;
+	st->last_len = t->len;
+}
+
+static uint64_t
+rnd(struct bench *b)
+{
+	b->rng ^= b->rng << 13;
+	b->rng ^= b->rng >> 7;
+	b->rng ^= b->rng << 17;
+	return b->rng;
+}
+
+static uint32_t
+walk(struct bench *b, const char *path)
+{
+	uint32_t n = ext2c_walk(b->fs, path, strlen(path));
+	if (!n) errx(1, "%s is missing, was the image made by bench.sh?", path);
+	return n;
+}
+
+static void
+begin(struct bench *b)
+{
+	b->reqs = b->dev->reqs;
+	b->bytes = b->dev->bytes;
+	memset(b->sites, 0, sizeof b->sites);
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void
+end(struct bench *b, const char *name, unsigned long ops)
+{
+	struct timespec now;
+	double secs;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - b->start.tv_sec) + (now.tv_nsec - b->start.tv_nsec) / 1e9;
+	if (ops == 0) ops = 1;
+	printf("%lu\t%u\t%s\t%s\t%lu\t%.6f\t%.1f\t%.2f\t%.1f\t",
+		(unsigned long)b->fs->block_size, b->fs->groups, b->fill, name, ops, secs,
+		secs > 0 ? ops / secs : 0,
+		(double)(b->dev->reqs - b->reqs) / ops,
+		(double)(b->dev->bytes - b->bytes) / ops);
+	if (!b->trace) {
+		printf("-\n");
+	} else {
+		unsigned long rereqs = 0;
+		for (int i = 0; i < Ext2SiteCount; i++) {
+			rereqs += b->sites[i].rereqs;
+		}
+		printf("%.2f\n", (double)rereqs / ops);
+		for (int i = 0; i < Ext2SiteCount; i++) {
+			struct sitestat *st = &b->sites[i];
+			if (st->reqs == 0) continue;
+			printf("%lu\t%u\t%s\t%s.%s\t%lu\t-\t-\t%.2f\t%.1f\t%.2f\n",
+				(unsigned long)b->fs->block_size, b->fs->groups, b->fill, name,
+				site_names[i], ops, (double)st->reqs / ops,
+				(double)st->bytes / ops, (double)st->rereqs / ops);
+		}
+	}
+	fflush(stdout);
+}
+
+/* 64 KiB reads over the whole file, a few times */
+static void
+bench_read_seq(struct bench *b)
+{
+	const size_t len = 64 << 10;
+	uint32_t n = walk(b, "/bench/big");
+	char *buf = malloc(len);
+	unsigned long ops = 0;
+	if (!buf) errx(1, "out of memory");
+	begin(b);
+	for (int pass = 0; pass < 4; pass++) {
+		for (size_t off = 0; ; off += len) {
+			int got = ext2_read(b->fs, n, buf, len, off);
+			ops++;
+			if (got < (int)len) break;
+		}
+	}
+	end(b, "read_seq", ops);
+	free(buf);
+}
+
+/* block sized reads at random block aligned offsets */
+static void
+bench_read_rand(struct bench *b)
+{
+	const unsigned long ops = 20000;
+	uint32_t n = walk(b, "/bench/big");
+	size_t blocks;
+	char *buf = malloc(b->fs->block_size);
+	if (!buf) errx(1, "out of memory");
+	{
+		struct ext2d_inode *inode = ext2_req_inode(b->fs, n);
+		if (!inode) errx(1, "couldn't get inode %u", n);
+		blocks = inode->size_lower / b->fs->block_size;
+		ext2_dropreq(b->fs, inode, false);
+	}
+	if (blocks == 0) errx(1, "/bench/big is empty");
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		size_t off = rnd(b) % blocks * b->fs->block_size;
+		if (ext2_read(b->fs, n, buf, b->fs->block_size, off) != (int)b->fs->block_size) {
+			errx(1, "short read at %zu", off);
+		}
+	}
+	end(b, "read_rand", ops);
+	free(buf);
+}
+
+static void
+bench_walk_deep(struct bench *b)
+{
+	const unsigned long ops = 2000;
+	char path[sizeof "/bench/deep" + DEPTH * 2];
+	strcpy(path, "/bench/deep");
+	for (int i = 0; i < DEPTH; i++) {
+		strcat(path, "/d");
+	}
+	walk(b, path);
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		ext2c_walk(b->fs, path, strlen(path));
+	}
+	end(b, "walk_deep", ops);
+}
+
+static void
+bench_walk_wide(struct bench *b)
+{
+	const unsigned long ops = 2000;
+	char path[64];
+	walk(b, "/bench/wide/f0");
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		sprintf(path, "/bench/wide/f%u", (unsigned)(rnd(b) % WIDE));
+		if (!ext2c_walk(b->fs, path, strlen(path))) {
+			errx(1, "%s is missing", path);
+		}
+	}
+	end(b, "walk_wide", ops);
+}
+
+/* one op per entry */
+static void
+bench_diriter(struct bench *b)
+{
+	uint32_t n = walk(b, "/bench/wide");
+	struct ext2_diriter iter;
+	unsigned long ops = 0;
+	begin(b);
+	for (int pass = 0; pass < 20; pass++) {
+		ext2_diriter(&iter, NULL, 0);
+		while (ext2_diriter(&iter, b->fs, n)) {
+			ops++;
+		}
+	}
+	end(b, "diriter", ops);
+}
+
+/* block sized appends to a new file, returns it */
+static uint32_t
+bench_write_append(struct bench *b)
+{
+	const unsigned long ops = 1024;
+	uint32_t dir = walk(b, "/bench");
+	uint32_t n;
+	char *buf = malloc(b->fs->block_size);
+	if (!buf) errx(1, "out of memory");
+	memset(buf, 'x', b->fs->block_size);
+	n = ext2_alloc_inode(b->fs, 0100644);
+	if (!n || ext2_link(b->fs, dir, "append", n, 1) < 0) {
+		errx(1, "couldn't create /bench/append");
+	}
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		if (ext2_write(b->fs, n, buf, b->fs->block_size, i * b->fs->block_size) <= 0) {
+			errx(1, "write error");
+		}
+	}
+	end(b, "write_append", ops);
+	free(buf);
+	return n;
+}
+
+/* one op is a link and an unlink of the same name */
+static void
+bench_link_churn(struct bench *b, uint32_t target)
+{
+	const unsigned long ops = 2000;
+	uint32_t dir = walk(b, "/bench/churn");
+	char name[32];
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		sprintf(name, "churn%lu", i % 16);
+		if (ext2_link(b->fs, dir, name, target, 1) < 0) {
+			errx(1, "couldn't link %s", name);
+		}
+		if (ext2_unlink(b->fs, dir, name) != target) {
+			errx(1, "couldn't unlink %s", name);
+		}
+	}
+	end(b, "link_churn", ops);
+}
+
+static void
+bench_alloc_block(struct bench *b)
+{
+	const unsigned long ops = 1000;
+	begin(b);
+	for (unsigned long i = 0; i < ops; i++) {
+		if (ext2_alloc_block(b->fs) == 0) {
+			errx(1, "out of space");
+		}
+	}
+	end(b, "alloc_block", ops);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b = {0};
+	struct e2device dev = {0};
+	uint32_t appended;
+
+	if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
+		b.trace = true;
+		argv++; argc--;
+	}
+	if (argc < 2) errx(1, "usage: ./e2bench [-t] image [fill label]");
+	b.fill = argc >= 3 ? argv[2] : "-";
+	b.rng = 0x9e3779b97f4a7c15ULL;
+
+	dev.fd = open(argv[1], O_RDWR);
+	if (dev.fd < 0) errx(1, "couldn't open %s", argv[1]);
+	b.dev = &dev;
+	b.fs = ext2_opendev(&dev, cnt_req, cnt_drop);
+	if (!b.fs) errx(1, "ext2_opendev failed");
+	if (!b.fs->rw) errx(1, "%s can't be written to", argv[1]);
+	if (b.trace) {
+		ext2_settrace(b.fs, tracer, &b);
+	}
+
+	bench_read_seq(&b);
+	bench_read_rand(&b);
+	bench_walk_deep(&b);
+	bench_walk_wide(&b);
+	bench_diriter(&b);
+	appended = bench_write_append(&b);
+	bench_link_churn(&b, appended);
+	bench_alloc_block(&b);
+
+	ext2_free(b.fs);
+	close(dev.fd);
+	return 0;
+}
@@ -0,0 +1,468 @@
+/* Populates an empty ext2 image with the contents of a host directory, without
+ * mounting it. Not part of the library.
+ *
+ * The tree is walked once, depth first. All the blocks of a file get allocated
+ * before any data is written, so they end up in as few contiguous runs as
+ * possible, and then the data gets streamed in with big writes.
+ * Directories are assembled in memory and written in one go once all of their
+ * entries are known, instead of being linked one entry at a time. Every inode
+ * gets its metadata filled in with a single request, and the directory counts
+ * only get added to the BGDs at the very end.
+ * The device is the write-back ex_shcache, which writes the dirty chunks back
+ * in device order, and evicts the file data before the metadata.
+ *   ./e2build [-c] image dir
+ * Files that are hard linked on the host are hard linked in the image too. With
+ * -c, every link after the first gets a copy of the file instead, made within
+ * the image with ext2_copy_range and exs_copy. */
+
+#include "ex_shcache.h"
+#include "ext2.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+#define DIRENT_SIZE(namelen) ((sizeof(struct ext2d_dirent) + namelen + 3) & ~3)
+#define IOBUF (1 << 20)
+#define USAGE "usage: ./e2build [-c] image dir"
+
+/* A directory that's being assembled. */
+struct dirbuf {
+	char *buf;
+	size_t len; /* end of the last entry */
+	size_t cap;
+	size_t last; /* offset of the last entry */
+};
+
+struct hardlink {
+	dev_t dev;
+	ino_t ino;
+	uint32_t inode_n;
+};
+
+struct build {
+	struct ext2 *fs;
+	char *iobuf;
+	uint32_t *dirs; /* new directories per group */
+	struct hardlink *links;
+	size_t links_len, links_cap;
+	bool copylinks;
+	unsigned long files, dirs_total;
+	unsigned long long bytes;
+};
+
+static int my_read(void *userdata, void *buf, size_t len, size_t off);
+static int my_write(void *userdata, const void *buf, size_t len, size_t off);
+static char *joinpath(const char *dir, const char *name);
+static uint8_t dirent_type(mode_t mode);
+static void dirbuf_add(struct build *b, struct dirbuf *d, uint32_t inode_n, const char *name, uint8_t type);
+static bool dirbuf_has(struct dirbuf *d, const char *name);
+static void dirbuf_finish(struct build *b, struct dirbuf *d);
+static void set_meta(struct build *b, uint32_t inode_n, const struct stat *st, uint16_t links);
+static uint32_t copy_file(struct build *b, const char *path, const struct stat *st, uint32_t src_n);
+static uint32_t add_file(struct build *b, const char *path, const struct stat *st);
+static uint32_t add_symlink(struct build *b, const char *path, const struct stat *st);
+static uint32_t add_special(struct build *b, const struct stat *st);
+static uint32_t add_dir(struct build *b, const char *path, uint32_t self_n, struct dirbuf *d, bool merge);
+
+static int
+my_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	if (pread((int)(intptr_t)userdata, buf, len, off) == (ssize_t)len) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static int
+my_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	if (pwrite((int)(intptr_t)userdata, buf, len, off) == (ssize_t)len) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static char *
+joinpath(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *s = malloc(dlen + nlen + 2);
+	if (!s) errx(1, "out of memory");
+	memcpy(s, dir, dlen);
+	s[dlen] = '/';
+	memcpy(s + dlen + 1, name, nlen + 1);
+	return s;
+}
+
+static uint8_t
+dirent_type(mode_t mode)
+{
+	if (S_ISREG(mode))  return 1;
+	if (S_ISDIR(mode))  return 2;
+	if (S_ISCHR(mode))  return 3;
+	if (S_ISBLK(mode))  return 4;
+	if (S_ISFIFO(mode)) return 5;
+	if (S_ISSOCK(mode)) return 6;
+	if (S_ISLNK(mode))  return 7;
+	return 0;
+}
+
+/* Entries can't cross block boundaries, and the last entry of every block
+ * has to span until its end. */
+static void
+dirbuf_add(struct build *b, struct dirbuf *d, uint32_t inode_n, const char *name, uint8_t type)
+{
+	size_t bs = b->fs->block_size;
+	size_t namelen = strlen(name);
+	size_t entlen = DIRENT_SIZE(namelen);
+	struct ext2d_dirent *ent;
+
+	if (d->len % bs + entlen > bs) {
+		struct ext2d_dirent *prev = (void*)(d->buf + d->last);
+		prev->size += bs - d->len % bs;
+		d->len += bs - d->len % bs;
+	}
+	if (d->len + bs > d->cap) {
+		d->cap = d->cap ? d->cap * 2 : bs * 4;
+		d->buf = realloc(d->buf, d->cap);
+		if (!d->buf) errx(1, "out of memory");
+	}
+	ent = (void*)(d->buf + d->len);
+	memset(ent, 0, entlen);
+	ent->inode = inode_n;
+	ent->size = entlen;
+	ent->namelen_lower = namelen;
+	ent->type = type;
+	memcpy(ent->name, name, namelen);
+	d->last = d->len;
+	d->len += entlen;
+}
+
+static bool
+dirbuf_has(struct dirbuf *d, const char *name)
+{
+	size_t namelen = strlen(name);
+	for (size_t pos = 0; pos < d->len; ) {
+		struct ext2d_dirent *ent = (void*)(d->buf + pos);
+		if (ent->namelen_lower == namelen && memcmp(ent->name, name, namelen) == 0) {
+			return true;
+		}
+		pos += ent->size;
+	}
+	return false;
+}
+
+static void
+dirbuf_finish(struct build *b, struct dirbuf *d)
+{
+	size_t bs = b->fs->block_size;
+	if (d->len % bs != 0) {
+		struct ext2d_dirent *prev = (void*)(d->buf + d->last);
+		prev->size += bs - d->len % bs;
+		d->len += bs - d->len % bs;
+	}
+}
+
+static void
+set_meta(struct build *b, uint32_t inode_n, const struct stat *st, uint16_t links)
+{
+	struct ext2d_inode *inode = ext2_req_inode(b->fs, inode_n);
+	if (!inode) errx(1, "couldn't get inode %u", inode_n);
+	inode->perms = st->st_mode;
+	inode->uid = st->st_uid;
+	inode->gid = st->st_gid;
+	inode->atime = st->st_atime;
+	inode->mtime = st->st_mtime;
+	inode->ctime = st->st_ctime;
+	inode->links = links;
+	ext2_dropreq(b->fs, inode, true);
+}
+
+/* The data gets copied from src_n, which is the same file on the host. */
+static uint32_t
+copy_file(struct build *b, const char *path, const struct stat *st, uint32_t src_n)
+{
+	struct ext2d_inode *inode;
+	uint32_t inode_n;
+	size_t size, off = 0;
+
+	inode = ext2_req_inode(b->fs, src_n);
+	if (!inode) errx(1, "couldn't get inode %u", src_n);
+	size = inode->size_lower;
+	ext2_dropreq(b->fs, inode, false);
+
+	inode_n = ext2_alloc_inode(b->fs, st->st_mode);
+	if (inode_n == 0) errx(1, "%s: couldn't allocate an inode", path);
+	while (off < size) {
+		int got = ext2_copy_range(b->fs, src_n, off, inode_n, off, size - off);
+		if (got <= 0) errx(1, "%s: couldn't copy inode %u", path, src_n);
+		off += got;
+	}
+	set_meta(b, inode_n, st, 1);
+	b->files++;
+	b->bytes += size;
+	return inode_n;
+}
+
+static uint32_t
+add_file(struct build *b, const char *path, const struct stat *st)
+{
+	uint32_t inode_n;
+	size_t off = 0;
+	int fd;
+
+	if (st->st_nlink > 1) {
+		for (size_t i = 0; i < b->links_len; i++) {
+			struct hardlink *h = &b->links[i];
+			if (h->dev == st->st_dev && h->ino == st->st_ino) {
+				struct ext2d_inode *inode;
+				if (b->copylinks) {
+					return copy_file(b, path, st, h->inode_n);
+				}
+				inode = ext2_req_inode(b->fs, h->inode_n);
+				if (!inode) errx(1, "couldn't get inode %u", h->inode_n);
+				inode->links++;
+				ext2_dropreq(b->fs, inode, true);
+				return h->inode_n;
+			}
+		}
+	}
+	if ((uint32_t)st->st_size != st->st_size) {
+		errx(1, "%s: too big", path);
+	}
+
+	inode_n = ext2_alloc_inode(b->fs, st->st_mode);
+	if (inode_n == 0) errx(1, "%s: couldn't allocate an inode", path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) errx(1, "couldn't open %s", path);
+	if (st->st_size > 0 && ext2_fallocate(b->fs, inode_n, 0, st->st_size) < 0) {
+		errx(1, "%s: out of space", path);
+	}
+	while (off < (size_t)st->st_size) {
+		size_t want = st->st_size - off;
+		ssize_t got;
+		if (want > IOBUF) want = IOBUF;
+		got = read(fd, b->iobuf, want);
+		if (got < 0) errx(1, "couldn't read %s", path);
+		if (got == 0) break;
+		if (ext2_write(b->fs, inode_n, b->iobuf, got, off) != got) {
+			errx(1, "%s: write error", path);
+		}
+		off += got;
+	}
+	close(fd);
+	if (off < (size_t)st->st_size && ext2_truncate(b->fs, inode_n, off) < 0) {
+		/* shrunk in the meantime, free the preallocated tail */
+		errx(1, "%s: couldn't truncate", path);
+	}
+	set_meta(b, inode_n, st, 1);
+	b->files++;
+	b->bytes += st->st_size;
+
+	if (st->st_nlink > 1) {
+		if (b->links_len == b->links_cap) {
+			b->links_cap = b->links_cap ? b->links_cap * 2 : 16;
+			b->links = realloc(b->links, b->links_cap * sizeof *b->links);
+			if (!b->links) errx(1, "out of memory");
+		}
+		b->links[b->links_len].dev = st->st_dev;
+		b->links[b->links_len].ino = st->st_ino;
+		b->links[b->links_len].inode_n = inode_n;
+		b->links_len++;
+	}
+	return inode_n;
+}
+
+static uint32_t
+add_symlink(struct build *b, const char *path, const struct stat *st)
+{
+	uint32_t inode_n;
+	ssize_t len = readlink(path, b->iobuf, IOBUF);
+	if (len < 0) errx(1, "couldn't read the link %s", path);
+
+	inode_n = ext2_alloc_inode(b->fs, st->st_mode);
+	if (inode_n == 0) errx(1, "%s: couldn't allocate an inode", path);
+	if ((size_t)len < sizeof ((struct ext2d_inode*)0)->block) {
+		/* fast symlink, stored in the block pointers */
+		struct ext2d_inode *inode = ext2_req_inode(b->fs, inode_n);
+		if (!inode) errx(1, "couldn't get inode %u", inode_n);
+		memcpy(inode->block, b->iobuf, len);
+		inode->size_lower = len;
+		ext2_dropreq(b->fs, inode, true);
+	} else if (ext2_write(b->fs, inode_n, b->iobuf, len, 0) != len) {
+		errx(1, "%s: write error", path);
+	}
+	set_meta(b, inode_n, st, 1);
+	b->files++;
+	return inode_n;
+}
+
+static uint32_t
+add_special(struct build *b, const struct stat *st)
+{
+	uint32_t inode_n = ext2_alloc_inode(b->fs, st->st_mode);
+	if (inode_n == 0) errx(1, "couldn't allocate an inode");
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+		uint32_t ma = major(st->st_rdev), mi = minor(st->st_rdev);
+		struct ext2d_inode *inode = ext2_req_inode(b->fs, inode_n);
+		if (!inode) errx(1, "couldn't get inode %u", inode_n);
+		if (ma < 256 && mi < 256) {
+			inode->block[0] = ma << 8 | mi;
+		} else {
+			inode->block[1] = (mi & 0xff) | ma << 8 | (mi & ~0xff) << 12;
+		}
+		ext2_dropreq(b->fs, inode, true);
+	}
+	set_meta(b, inode_n, st, 1);
+	b->files++;
+	return inode_n;
+}
+
+/* Adds all the entries of the host directory path to d, and writes d to
+ * self_n. If merge is set, entries that are already in d get skipped.
+ * @return the amount of subdirectories added */
+static uint32_t
+add_dir(struct build *b, const char *path, uint32_t self_n, struct dirbuf *d, bool merge)
+{
+	struct dirent **names;
+	uint32_t subdirs = 0;
+	int amt = scandir(path, &names, NULL, alphasort);
+	if (amt < 0) errx(1, "couldn't open %s", path);
+
+	for (int i = 0; i < amt; i++) {
+		const char *name = names[i]->d_name;
+		char *child = joinpath(path, name);
+		struct stat st;
+		uint32_t inode_n;
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) goto next;
+		if (strlen(name) > 255) errx(1, "%s: name too long", child);
+		if (merge && dirbuf_has(d, name)) {
+			fprintf(stderr, "%s already exists, skipping\n", child);
+			goto next;
+		}
+		if (lstat(child, &st) < 0) errx(1, "couldn't stat %s", child);
+
+		if (S_ISDIR(st.st_mode)) {
+			struct dirbuf sub = {0};
+			uint32_t sub_dirs;
+			inode_n = ext2_alloc_inode(b->fs, st.st_mode);
+			if (inode_n == 0) errx(1, "%s: couldn't allocate an inode", child);
+			dirbuf_add(b, &sub, inode_n, ".", 2);
+			dirbuf_add(b, &sub, self_n, "..", 2);
+			sub_dirs = add_dir(b, child, inode_n, &sub, false);
+			free(sub.buf);
+			set_meta(b, inode_n, &st, 2 + sub_dirs);
+			b->dirs[(inode_n - 1) / b->fs->inodes_per_group]++;
+			b->dirs_total++;
+			subdirs++;
+		} else if (S_ISREG(st.st_mode)) {
+			inode_n = add_file(b, child, &st);
+		} else if (S_ISLNK(st.st_mode)) {
+			inode_n = add_symlink(b, child, &st);
+		} else {
+			inode_n = add_special(b, &st);
+		}
+		dirbuf_add(b, d, inode_n, name, dirent_type(st.st_mode));
+next:
+		free(child);
+		free(names[i]);
+	}
+	free(names);
+
+	dirbuf_finish(b, d);
+	if (ext2_write(b->fs, self_n, d->buf, d->len, 0) != (int)d->len) {
+		errx(1, "%s: couldn't write the directory", path);
+	}
+	return subdirs;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct build b = {0};
+	struct dirbuf root = {0};
+	struct ext2_diriter iter;
+	struct stat st;
+	uint32_t subdirs;
+	uint16_t links;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c': b.copylinks = true; break;
+		default: errx(1, USAGE);
+		}
+	}
+	if (argc - optind != 2) errx(1, USAGE);
+	if (stat(argv[optind + 1], &st) < 0 || !S_ISDIR(st.st_mode)) {
+		errx(1, "%s isn't a directory", argv[optind + 1]);
+	}
+
+	int fd = open(argv[optind], O_RDWR);
+	if (fd < 0) errx(1, "couldn't open %s", argv[optind]);
+
+	/* Single threaded, so a single big shard. Dirty chunks mostly stay
+	 * cached until the final sync. */
+	struct e2device *dev = exs_init(my_read, my_write, (void*)(intptr_t)fd, 1, 64 << 20, 1 << 16);
+	if (!dev) errx(1, "exs_init failed");
+	b.fs = ext2_opendev(dev, exs_req, exs_drop);
+	if (!b.fs) errx(1, "ext2_opendev failed");
+	if (!b.fs->rw) errx(1, "%s can't be written to", argv[optind]);
+	/* keeps the file data from pushing the inode tables and bitmaps out */
+	ext2_setreqh(b.fs, exs_reqh);
+	ext2_setcopy(b.fs, exs_copy);
+
+	b.iobuf = malloc(IOBUF);
+	b.dirs = calloc(b.fs->groups, sizeof *b.dirs);
+	if (!b.iobuf || !b.dirs) errx(1, "out of memory");
+
+	/* the root directory keeps whatever it already has, e.g. lost+found */
+	ext2_diriter(&iter, NULL, 0);
+	while (ext2_diriter(&iter, b.fs, 2)) {
+		char name[256];
+		memcpy(name, iter.ent->name, iter.ent->namelen_lower);
+		name[iter.ent->namelen_lower] = '\0';
+		dirbuf_add(&b, &root, iter.ent->inode, name, iter.ent->type);
+	}
+	subdirs = add_dir(&b, argv[optind + 1], 2, &root, true);
+	free(root.buf);
+	{
+		struct ext2d_inode *inode = ext2_req_inode(b.fs, 2);
+		if (!inode) errx(1, "couldn't get the root inode");
+		links = inode->links;
+		ext2_dropreq(b.fs, inode, false);
+	}
+	set_meta(&b, 2, &st, links + subdirs);
+
+	for (uint32_t g = 0; g < b.fs->groups; g++) {
+		struct ext2d_bgd *bgd;
+		if (b.dirs[g] == 0) continue;
+		bgd = ext2_req_bgdt(b.fs, g);
+		if (!bgd) errx(1, "couldn't get the BGD of group %u", g);
+		bgd->directory_amt += b.dirs[g];
+		ext2_dropreq(b.fs, bgd, true);
+	}
+
+	printf("%lu files, %lu directories, %llu bytes\n", b.files, b.dirs_total, b.bytes);
+	ext2_free(b.fs);
+	exs_free(dev);
+	close(fd);
+	free(b.iobuf);
+	free(b.dirs);
+	free(b.links);
+	return 0;
+}
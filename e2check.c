@@ -0,0 +1,452 @@
+/* A read-only consistency checker, checking one block group per thread.
+ * Not part of the library.
+ *
+ * The first pass compares the bitmaps of every group with the free counts in
+ * its BGD, and keeps a copy of the block bitmaps. The second one walks the
+ * block maps of all the used inodes, looking for blocks that are referenced
+ * twice, or that are used while being marked as free.
+ *
+ * Several images get checked at the same time, splitting the threads between
+ * them. They share a single cache pool, so the memory used doesn't grow with
+ * the number of images. The reports are printed in the order of the
+ * arguments. */
+
+#include "ex_shcache.h"
+#include "ex_zimage.h"
+#include "ext2.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+#define REPORT_MAX 8 /* per group and problem type */
+
+struct groupres {
+	uint32_t inodes_free, blocks_free; /* according to the bitmaps */
+	unsigned long inodes_used, blocks_ref;
+	unsigned long dup, unmarked, outside, unreadable;
+	/* the first few problems, for the report */
+	uint32_t dup_b[REPORT_MAX], unmarked_b[REPORT_MAX], outside_i[REPORT_MAX];
+	bool bitmap_err;
+};
+
+struct check {
+	const char *path;
+	struct exs_pool *pool;
+	int fd;
+	struct exz *z;
+	struct e2device *dev;
+	int threads;
+	uint32_t sb_inodes_free, sb_blocks_free;
+
+	struct ext2 *fs;
+	uint32_t blocks_total;
+	uint32_t first_ino;
+	uint8_t *bitmap; /* copy of all the block bitmaps */
+	uint8_t *seen; /* blocks referenced by any inode so far */
+	struct groupres *res;
+	uint32_t next; /* next group to check */
+	int pass;
+};
+
+/* the state of pass_inodes, for check_inode */
+struct scan {
+	struct check *c;
+	struct groupres *r;
+};
+
+static int my_read(void *userdata, void *buf, size_t len, size_t off);
+static int my_write(void *userdata, const void *buf, size_t len, size_t off);
+static uint32_t group_blocks(struct check *c, uint32_t group);
+static uint32_t count_free(const uint8_t *bitmap, uint32_t bits);
+static void pass_bitmaps(struct check *c, uint32_t group);
+static void use_block(struct check *c, struct groupres *r, uint32_t inode_n, uint32_t block);
+static void walk_indirect(struct check *c, struct groupres *r, uint32_t inode_n, uint32_t block, int depth);
+static int check_inode(void *userdata, uint32_t inode_n, const struct ext2d_inode *inode);
+static void pass_inodes(struct check *c, uint32_t group);
+static void *worker(void *arg);
+static void run_pass(struct check *c, int pass, int threads);
+static void *check_image(void *arg);
+static unsigned long report(struct check *c);
+static void close_image(struct check *c);
+
+static int
+my_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	if (pread((int)(intptr_t)userdata, buf, len, off) == (ssize_t)len) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static int
+my_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	(void)userdata; (void)buf; (void)len; (void)off;
+	return -1; /* read-only */
+}
+
+static uint32_t
+group_blocks(struct check *c, uint32_t group)
+{
+	struct ext2 *fs = c->fs;
+	if (group + 1 < fs->groups) return fs->blocks_per_group;
+	return c->blocks_total - fs->first_data_block - group * fs->blocks_per_group;
+}
+
+static uint32_t
+count_free(const uint8_t *bitmap, uint32_t bits)
+{
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < bits; i++) {
+		if (!(bitmap[i / 8] & (1 << (i % 8)))) n++;
+	}
+	return n;
+}
+
+static void
+pass_bitmaps(struct check *c, uint32_t group)
+{
+	struct ext2 *fs = c->fs;
+	struct groupres *r = &c->res[group];
+	uint32_t blocks = group_blocks(c, group);
+	uint8_t *bitmap;
+
+	bitmap = ext2_req_bitmap(fs, group, Ext2Inode);
+	if (!bitmap) {
+		r->bitmap_err = true;
+		return;
+	}
+	r->inodes_free = count_free(bitmap, fs->inodes_per_group);
+	ext2_dropreq(fs, bitmap, false);
+
+	bitmap = ext2_req_bitmap(fs, group, Ext2Block);
+	if (!bitmap) {
+		r->bitmap_err = true;
+		return;
+	}
+	r->blocks_free = count_free(bitmap, blocks);
+	/* blocks_per_group is a multiple of 8, so no other group shares the bytes */
+	memcpy(c->bitmap + group * fs->blocks_per_group / 8, bitmap, (blocks + 7) / 8);
+	ext2_dropreq(fs, bitmap, false);
+}
+
+static void
+use_block(struct check *c, struct groupres *r, uint32_t inode_n, uint32_t block)
+{
+	uint32_t rel = block - c->fs->first_data_block;
+	uint8_t mask = 1 << (rel % 8);
+	r->blocks_ref++;
+	if (block < c->fs->first_data_block || block >= c->blocks_total) {
+		if (r->outside < REPORT_MAX) r->outside_i[r->outside] = inode_n;
+		r->outside++;
+		return;
+	}
+	if (__atomic_fetch_or(&c->seen[rel / 8], mask, __ATOMIC_RELAXED) & mask) {
+		if (r->dup < REPORT_MAX) r->dup_b[r->dup] = block;
+		r->dup++;
+	}
+	if (!(c->bitmap[rel / 8] & mask)) {
+		if (r->unmarked < REPORT_MAX) r->unmarked_b[r->unmarked] = block;
+		r->unmarked++;
+	}
+}
+
+/* ext2_req_blockmap only exposes the data blocks, so the indirect blocks
+ * themselves are found here. depth is the depth of block, only blocks with
+ * depth > 1 point to other indirect blocks. */
+static void
+walk_indirect(struct check *c, struct groupres *r, uint32_t inode_n, uint32_t block, int depth)
+{
+	struct ext2 *fs = c->fs;
+	uint32_t *ptrs;
+	size_t per = fs->block_size / 4;
+
+	use_block(c, r, inode_n, block);
+	if (depth == 1 || block >= c->blocks_total) return;
+
+	ptrs = malloc(fs->block_size);
+	if (!ptrs) {
+		r->unreadable++;
+		return;
+	}
+	{
+		void *p = fs->req(fs->dev, fs->block_size, (uint64_t)block * fs->block_size);
+		if (!p) {
+			r->unreadable++;
+			free(ptrs);
+			return;
+		}
+		memcpy(ptrs, p, fs->block_size);
+		ext2_dropreq(fs, p, false);
+	}
+	for (size_t i = 0; i < per; i++) {
+		if (ptrs[i] != 0) {
+			walk_indirect(c, r, inode_n, ptrs[i], depth - 1);
+		}
+	}
+	free(ptrs);
+}
+
+static int
+check_inode(void *userdata, uint32_t inode_n, const struct ext2d_inode *inode)
+{
+	struct scan *s = userdata;
+	struct check *c = s->c;
+	struct groupres *r = s->r;
+	struct ext2 *fs = c->fs;
+	uint32_t indirect[3];
+	uint64_t blocks;
+	uint16_t type;
+
+	if (inode_n < c->first_ino && inode_n != 2) return 0; /* reserved */
+	r->inodes_used++;
+
+	type = inode->perms >> 12;
+	blocks = ((uint64_t)inode->size_lower + fs->block_size - 1) / fs->block_size;
+	indirect[0] = inode->indirect_1;
+	indirect[1] = inode->indirect_2;
+	indirect[2] = inode->indirect_3;
+	/* fast symlinks keep the target in the block map */
+	if (type == 0xA && inode->sectors == 0) type = 0;
+	if (type != 0x4 && type != 0x8 && type != 0xA) return 0;
+
+	for (int d = 0; d < 3; d++) {
+		if (indirect[d] != 0) {
+			walk_indirect(c, r, inode_n, indirect[d], d + 1);
+		}
+	}
+
+	for (uint64_t off = 0; off < blocks; ) {
+		size_t len;
+		uint32_t *map = ext2_req_blockmap(fs, inode_n, &len, off, false);
+		if (!map) {
+			r->unreadable++;
+			break;
+		}
+		for (size_t i = 0; i < len && off + i < blocks; i++) {
+			if (map[i] != 0) {
+				use_block(c, r, inode_n, map[i]);
+			}
+		}
+		ext2_dropreq(fs, map, false);
+		off += len;
+	}
+	return 0;
+}
+
+/* The inode table gets read sequentially, a block at a time. */
+static void
+pass_inodes(struct check *c, uint32_t group)
+{
+	struct scan s = {c, &c->res[group]};
+	if (s.r->bitmap_err) return;
+	if (ext2_bulkstat(c->fs, group, 0, c->fs->inodes_per_group, check_inode, &s) < 0) {
+		s.r->unreadable++;
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct check *c = arg;
+	for (;;) {
+		uint32_t group = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+		if (group >= c->fs->groups) break;
+		if (c->pass == 1) {
+			pass_bitmaps(c, group);
+		} else {
+			pass_inodes(c, group);
+		}
+	}
+	return NULL;
+}
+
+static void
+run_pass(struct check *c, int pass, int threads)
+{
+	pthread_t *t = calloc(threads, sizeof *t);
+	if (!t) errx(8, "out of memory");
+	c->pass = pass;
+	c->next = 0;
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&t[i], NULL, worker, c) != 0) {
+			errx(8, "couldn't create a thread");
+		}
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(t[i], NULL);
+	}
+	free(t);
+}
+
+/* Opens the image and runs both passes, report prints the results. */
+static void *
+check_image(void *arg)
+{
+	struct check *c = arg;
+	c->fd = open(c->path, O_RDONLY);
+	if (c->fd < 0) errx(8, "couldn't open %s", c->path);
+
+	/* 64KiB chunks fit any block size */
+	c->z = exz_open(c->fd, 64);
+	if (c->z) {
+		c->dev = exs_attach(c->pool, exz_read, exz_write, c->z);
+	} else {
+		c->dev = exs_attach(c->pool, my_read, my_write, (void*)(intptr_t)c->fd);
+	}
+	if (!c->dev) errx(8, "exs_attach failed");
+	c->fs = ext2_opendev(c->dev, exs_req, exs_drop);
+	if (!c->fs) errx(8, "%s: ext2_opendev failed", c->path);
+	ext2_setro(c->fs);
+
+	{
+		struct ext2d_superblock *sb = ext2_req_sb(c->fs);
+		if (!sb) errx(8, "%s: couldn't read the superblock", c->path);
+		c->blocks_total = sb->blocks_total;
+		c->first_ino = sb->inode_first;
+		c->sb_inodes_free = sb->inodes_free;
+		c->sb_blocks_free = sb->blocks_free;
+		ext2_dropreq(c->fs, sb, false);
+	}
+	c->bitmap = calloc(c->blocks_total / 8 + 1, 1);
+	c->seen = calloc(c->blocks_total / 8 + 1, 1);
+	c->res = calloc(c->fs->groups, sizeof *c->res);
+	if (!c->bitmap || !c->seen || !c->res) errx(8, "out of memory");
+
+	run_pass(c, 1, c->threads);
+	run_pass(c, 2, c->threads);
+	return NULL;
+}
+
+/* Merges the results of all the groups, and prints the problems found.
+ * @return the number of problems */
+static unsigned long
+report(struct check *c)
+{
+	uint32_t inodes_free = 0, blocks_free = 0;
+	unsigned long problems = 0;
+
+	for (uint32_t g = 0; g < c->fs->groups; g++) {
+		struct groupres *r = &c->res[g];
+		struct ext2d_bgd *bgd;
+		if (r->bitmap_err) {
+			printf("group %u: couldn't read the bitmaps\n", g);
+			problems++;
+			continue;
+		}
+		inodes_free += r->inodes_free;
+		blocks_free += r->blocks_free;
+
+		bgd = ext2_req_bgdt(c->fs, g);
+		if (!bgd) errx(8, "%s: couldn't read the BGD of group %u", c->path, g);
+		if (bgd->inodes_free != r->inodes_free) {
+			printf("group %u: %u free inodes, the BGD says %u\n", g, r->inodes_free, bgd->inodes_free);
+			problems++;
+		}
+		if (bgd->blocks_free != r->blocks_free) {
+			printf("group %u: %u free blocks, the BGD says %u\n", g, r->blocks_free, bgd->blocks_free);
+			problems++;
+		}
+		ext2_dropreq(c->fs, bgd, false);
+
+		for (unsigned long i = 0; i < r->dup && i < REPORT_MAX; i++) {
+			printf("group %u: block %u is used more than once\n", g, r->dup_b[i]);
+		}
+		for (unsigned long i = 0; i < r->unmarked && i < REPORT_MAX; i++) {
+			printf("group %u: block %u is used, but marked as free\n", g, r->unmarked_b[i]);
+		}
+		for (unsigned long i = 0; i < r->outside && i < REPORT_MAX; i++) {
+			printf("group %u: inode %u points outside of the filesystem\n", g, r->outside_i[i]);
+		}
+		if (r->unreadable) {
+			printf("group %u: %lu unreadable inodes or block maps\n", g, r->unreadable);
+		}
+		problems += r->dup + r->unmarked + r->outside + r->unreadable;
+	}
+	if (inodes_free != c->sb_inodes_free) {
+		printf("%u free inodes, the superblock says %u\n", inodes_free, c->sb_inodes_free);
+		problems++;
+	}
+	if (blocks_free != c->sb_blocks_free) {
+		printf("%u free blocks, the superblock says %u\n", blocks_free, c->sb_blocks_free);
+		problems++;
+	}
+
+	{
+		unsigned long used = 0, refs = 0;
+		for (uint32_t g = 0; g < c->fs->groups; g++) {
+			used += c->res[g].inodes_used;
+			refs += c->res[g].blocks_ref;
+		}
+		printf("%s: %lu inodes, %lu block references, %lu problems\n", c->path, used, refs, problems);
+	}
+	return problems;
+}
+
+static void
+close_image(struct check *c)
+{
+	ext2_free(c->fs);
+	exs_free(c->dev);
+	if (c->z) exz_free(c->z);
+	close(c->fd);
+	free(c->bitmap);
+	free(c->seen);
+	free(c->res);
+}
+
+int
+main(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int images;
+	struct check *checks;
+	pthread_t *t;
+	struct exs_pool *pool;
+	unsigned long problems = 0;
+
+	if (argc >= 4 && strcmp(argv[1], "-j") == 0) {
+		threads = atoi(argv[2]);
+		argv += 2; argc -= 2;
+	}
+	if (argc < 2) errx(8, "usage: ./e2check [-j threads] image...");
+	if (threads < 1) threads = 1;
+	images = argc - 1;
+
+	pool = exs_pool_init(64, 1 << 20, 1 << 16);
+	if (!pool) errx(8, "exs_pool_init failed");
+	checks = calloc(images, sizeof *checks);
+	t = calloc(images, sizeof *t);
+	if (!checks || !t) errx(8, "out of memory");
+	for (int i = 0; i < images; i++) {
+		checks[i].path = argv[i + 1];
+		checks[i].pool = pool;
+		/* the remainder goes to the first few */
+		checks[i].threads = threads / images + (i < threads % images);
+		if (checks[i].threads < 1) checks[i].threads = 1;
+		if (pthread_create(&t[i], NULL, check_image, &checks[i]) != 0) {
+			errx(8, "couldn't create a thread");
+		}
+	}
+	for (int i = 0; i < images; i++) {
+		pthread_join(t[i], NULL);
+	}
+	for (int i = 0; i < images; i++) {
+		problems += report(&checks[i]);
+		close_image(&checks[i]);
+	}
+	exs_pool_free(pool);
+	free(checks);
+	free(t);
+	return problems ? 1 : 0;
+}
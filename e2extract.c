@@ -0,0 +1,406 @@
+/* Extracts an image, or a subtree of it, to a host directory. Not part of the
+ * library.
+ *
+ * The tree gets walked first, creating the directories, symlinks and empty
+ * files, and collecting the extents of every file with ext2_inode_ondisk.
+ * The extents are then sorted by their position on the device, which gets
+ * read front to back in big windows, scattering the data into the output
+ * files. Permissions and times are only applied at the very end, so that
+ * read-only files and directories can still be filled. */
+
+/* for mknod */
+#define _XOPEN_SOURCE 700
+
+#include "ex_shcache.h"
+#include "ex_zimage.h"
+#include "ext2.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+#define WINDOW (4 << 20) /* biggest single device read */
+#define GAP (64 << 10) /* holes smaller than this get read through */
+#define FDCACHE 64
+
+struct extent {
+	uint64_t dev_off;
+	uint32_t len;
+	uint32_t file;
+	uint32_t off;
+};
+
+/* Applied once all the data is in place. */
+struct entry {
+	char *path;
+	uint32_t inode_n;
+	uint16_t perms;
+	uint32_t atime, mtime;
+};
+
+struct extract {
+	struct ext2 *fs;
+	int img;
+	struct exz *z; /* if the image is compressed */
+	struct entry *ents;
+	size_t ents_len, ents_cap;
+	struct extent *exts;
+	size_t exts_len, exts_cap;
+	struct {
+		uint32_t file;
+		int fd;
+	} fds[FDCACHE];
+	unsigned long files, dirs;
+	unsigned long long bytes, reads;
+};
+
+static int my_read(void *userdata, void *buf, size_t len, size_t off);
+static int my_write(void *userdata, const void *buf, size_t len, size_t off);
+static char *joinpath(const char *dir, const char *name);
+static uint32_t add_entry(struct extract *x, char *path, uint32_t inode_n, const struct ext2d_inode *inode);
+static void add_extent(struct extract *x, uint32_t file, uint64_t dev_off, uint32_t len, uint32_t off);
+static void collect(struct extract *x, uint32_t file, uint32_t size);
+static void extract_symlink(struct extract *x, const char *path, uint32_t inode_n, const struct ext2d_inode *inode);
+static void extract_inode(struct extract *x, char *path, uint32_t inode_n);
+static void extract_dir(struct extract *x, const char *path, uint32_t inode_n);
+static int extent_cmp(const void *a, const void *b);
+static int file_fd(struct extract *x, uint32_t file);
+static void stream(struct extract *x);
+static void finish(struct extract *x);
+
+static int
+my_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	if (pread((int)(intptr_t)userdata, buf, len, off) == (ssize_t)len) {
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+static int
+my_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	(void)userdata; (void)buf; (void)len; (void)off;
+	return -1; /* read-only */
+}
+
+static char *
+joinpath(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *s = malloc(dlen + nlen + 2);
+	if (!s) errx(1, "out of memory");
+	memcpy(s, dir, dlen);
+	s[dlen] = '/';
+	memcpy(s + dlen + 1, name, nlen + 1);
+	return s;
+}
+
+/* Takes ownership of path. */
+static uint32_t
+add_entry(struct extract *x, char *path, uint32_t inode_n, const struct ext2d_inode *inode)
+{
+	struct entry *e;
+	if (x->ents_len == x->ents_cap) {
+		x->ents_cap = x->ents_cap ? x->ents_cap * 2 : 256;
+		x->ents = realloc(x->ents, x->ents_cap * sizeof *x->ents);
+		if (!x->ents) errx(1, "out of memory");
+	}
+	e = &x->ents[x->ents_len];
+	e->path = path;
+	e->inode_n = inode_n;
+	e->perms = inode->perms;
+	e->atime = inode->atime;
+	e->mtime = inode->mtime;
+	return x->ents_len++;
+}
+
+static void
+add_extent(struct extract *x, uint32_t file, uint64_t dev_off, uint32_t len, uint32_t off)
+{
+	if (x->exts_len > 0) {
+		struct extent *last = &x->exts[x->exts_len - 1];
+		if (last->file == file && last->dev_off + last->len == dev_off
+			&& last->off + last->len == off && last->len + len <= WINDOW)
+		{
+			last->len += len;
+			return;
+		}
+	}
+	if (x->exts_len == x->exts_cap) {
+		x->exts_cap = x->exts_cap ? x->exts_cap * 2 : 1024;
+		x->exts = realloc(x->exts, x->exts_cap * sizeof *x->exts);
+		if (!x->exts) errx(1, "out of memory");
+	}
+	x->exts[x->exts_len].dev_off = dev_off;
+	x->exts[x->exts_len].len = len;
+	x->exts[x->exts_len].file = file;
+	x->exts[x->exts_len].off = off;
+	x->exts_len++;
+}
+
+static void
+collect(struct extract *x, uint32_t file, uint32_t size)
+{
+	uint32_t inode_n = x->ents[file].inode_n;
+	for (size_t pos = 0; pos < size; ) {
+		size_t dev_off, dev_len;
+		switch (ext2_inode_ondisk(x->fs, inode_n, pos, &dev_off, &dev_len)) {
+		case 0:
+			break;
+		case 1:
+			/* a hole, the output file is already sized */
+			pos += dev_len;
+			continue;
+		default:
+			errx(1, "inode %u: couldn't read the block map", inode_n);
+		}
+		if (dev_len > size - pos) {
+			dev_len = size - pos;
+		}
+		add_extent(x, file, dev_off, dev_len, pos);
+		pos += dev_len;
+	}
+}
+
+static void
+extract_symlink(struct extract *x, const char *path, uint32_t inode_n, const struct ext2d_inode *inode)
+{
+	char target[4096];
+	size_t len = inode->size_lower;
+	if (len >= sizeof target) errx(1, "%s: link too long", path);
+	if (inode->sectors == 0) {
+		/* fast symlink, stored in the block pointers */
+		memcpy(target, inode->block, len);
+	} else if ((size_t)ext2_read(x->fs, inode_n, target, len, 0) != len) {
+		errx(1, "%s: couldn't read the link", path);
+	}
+	target[len] = '\0';
+	if (symlink(target, path) < 0) errx(1, "couldn't create %s", path);
+}
+
+/* Takes ownership of path. */
+static void
+extract_inode(struct extract *x, char *path, uint32_t inode_n)
+{
+	struct ext2d_inode inode;
+	{
+		struct ext2d_inode *p = ext2_req_inode(x->fs, inode_n);
+		if (!p) errx(1, "couldn't get inode %u", inode_n);
+		inode = *p;
+		ext2_dropreq(x->fs, p, false);
+	}
+
+	if (inode.links > 1 && S_ISREG(inode.perms)) {
+		for (size_t i = 0; i < x->ents_len; i++) {
+			if (x->ents[i].inode_n == inode_n) {
+				if (link(x->ents[i].path, path) < 0) {
+					errx(1, "couldn't link %s", path);
+				}
+				free(path);
+				return;
+			}
+		}
+	}
+
+	if (S_ISDIR(inode.perms)) {
+		if (mkdir(path, 0700) < 0) errx(1, "couldn't create %s", path);
+		add_entry(x, path, inode_n, &inode);
+		extract_dir(x, path, inode_n);
+		x->dirs++;
+	} else if (S_ISREG(inode.perms)) {
+		uint32_t file;
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd < 0) errx(1, "couldn't create %s", path);
+		if (ftruncate(fd, inode.size_lower) < 0) errx(1, "couldn't resize %s", path);
+		close(fd);
+		file = add_entry(x, path, inode_n, &inode);
+		collect(x, file, inode.size_lower);
+		x->files++;
+		x->bytes += inode.size_lower;
+	} else if (S_ISLNK(inode.perms)) {
+		extract_symlink(x, path, inode_n, &inode);
+		add_entry(x, path, inode_n, &inode);
+		x->files++;
+	} else {
+		dev_t dev = 0;
+		if (S_ISCHR(inode.perms) || S_ISBLK(inode.perms)) {
+			if (inode.block[0]) {
+				dev = makedev(inode.block[0] >> 8 & 0xff, inode.block[0] & 0xff);
+			} else {
+				dev = makedev(inode.block[1] >> 8 & 0xfff,
+					(inode.block[1] & 0xff) | (inode.block[1] >> 12 & 0xfff00));
+			}
+		}
+		if (mknod(path, inode.perms, dev) < 0) {
+			fprintf(stderr, "couldn't create %s, skipping\n", path);
+			free(path);
+			return;
+		}
+		add_entry(x, path, inode_n, &inode);
+		x->files++;
+	}
+}
+
+static void
+extract_dir(struct extract *x, const char *path, uint32_t inode_n)
+{
+	struct ext2_diriter iter;
+	ext2_diriter(&iter, NULL, 0);
+	while (ext2_diriter(&iter, x->fs, inode_n)) {
+		char name[256];
+		memcpy(name, iter.ent->name, iter.ent->namelen_lower);
+		name[iter.ent->namelen_lower] = '\0';
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		extract_inode(x, joinpath(path, name), iter.ent->inode);
+	}
+}
+
+static int
+extent_cmp(const void *a, const void *b)
+{
+	const struct extent *ea = a, *eb = b;
+	return (ea->dev_off > eb->dev_off) - (ea->dev_off < eb->dev_off);
+}
+
+static int
+file_fd(struct extract *x, uint32_t file)
+{
+	int slot = file % FDCACHE;
+	if (x->fds[slot].fd >= 0 && x->fds[slot].file == file) {
+		return x->fds[slot].fd;
+	}
+	if (x->fds[slot].fd >= 0) {
+		close(x->fds[slot].fd);
+	}
+	x->fds[slot].file = file;
+	x->fds[slot].fd = open(x->ents[file].path, O_WRONLY);
+	if (x->fds[slot].fd < 0) errx(1, "couldn't open %s", x->ents[file].path);
+	return x->fds[slot].fd;
+}
+
+/* Reads the device front to back, each read covering as many extents as fit
+ * in a window. Small gaps between them get read through instead of seeking. */
+static void
+stream(struct extract *x)
+{
+	char *buf = malloc(WINDOW);
+	if (!buf) errx(1, "out of memory");
+	qsort(x->exts, x->exts_len, sizeof *x->exts, extent_cmp);
+	for (int i = 0; i < FDCACHE; i++) {
+		x->fds[i].fd = -1;
+	}
+
+	for (size_t i = 0; i < x->exts_len; ) {
+		uint64_t start = x->exts[i].dev_off;
+		uint64_t end = start + x->exts[i].len;
+		size_t j = i + 1;
+		while (j < x->exts_len && x->exts[j].dev_off <= end + GAP
+			&& x->exts[j].dev_off + x->exts[j].len - start <= WINDOW)
+		{
+			if (end < x->exts[j].dev_off + x->exts[j].len) {
+				end = x->exts[j].dev_off + x->exts[j].len;
+			}
+			j++;
+		}
+		if (x->z ? exz_read(x->z, buf, end - start, start) < 0
+			: my_read((void*)(intptr_t)x->img, buf, end - start, start) < 0)
+		{
+			errx(1, "couldn't read the image at %lu", (unsigned long)start);
+		}
+		x->reads++;
+		for (; i < j; i++) {
+			struct extent *e = &x->exts[i];
+			int fd = file_fd(x, e->file);
+			if (pwrite(fd, buf + (e->dev_off - start), e->len, e->off) != (ssize_t)e->len) {
+				errx(1, "couldn't write to %s", x->ents[e->file].path);
+			}
+		}
+	}
+	for (int i = 0; i < FDCACHE; i++) {
+		if (x->fds[i].fd >= 0) close(x->fds[i].fd);
+	}
+	free(buf);
+}
+
+/* Children come after their parents, so going backwards sets the times of
+ * every directory after its contents are done. */
+static void
+finish(struct extract *x)
+{
+	for (size_t i = x->ents_len; i-- > 0; ) {
+		struct entry *e = &x->ents[i];
+		struct timespec ts[2] = {{e->atime, 0}, {e->mtime, 0}};
+		if (!S_ISLNK(e->perms) && chmod(e->path, e->perms & 07777) < 0) {
+			fprintf(stderr, "couldn't chmod %s\n", e->path);
+		}
+		utimensat(AT_FDCWD, e->path, ts, AT_SYMLINK_NOFOLLOW);
+		free(e->path);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct extract x = {0};
+	const char *src = argc >= 4 ? argv[3] : "/";
+	uint32_t inode_n;
+	bool isdir;
+
+	if (argc < 3) errx(1, "usage: ./e2extract image outdir [path]");
+
+	x.img = open(argv[1], O_RDONLY);
+	if (x.img < 0) errx(1, "couldn't open %s", argv[1]);
+
+	/* the metadata goes through the cache, the data gets read directly */
+	x.z = exz_open(x.img, 16);
+	struct e2device *dev;
+	if (x.z) {
+		dev = exs_init(exz_read, exz_write, x.z, 1, 16 << 20, 1 << 16);
+	} else {
+		dev = exs_init(my_read, my_write, (void*)(intptr_t)x.img, 1, 16 << 20, 1 << 16);
+	}
+	if (!dev) errx(1, "exs_init failed");
+	x.fs = ext2_opendev(dev, exs_req, exs_drop);
+	if (!x.fs) errx(1, "ext2_opendev failed");
+	ext2_setro(x.fs);
+
+	inode_n = ext2c_walk(x.fs, src, strlen(src));
+	if (!inode_n) errx(1, "%s doesn't exist", src);
+	{
+		struct ext2d_inode *inode = ext2_req_inode(x.fs, inode_n);
+		if (!inode) errx(1, "couldn't get inode %u", inode_n);
+		isdir = S_ISDIR(inode->perms);
+		ext2_dropreq(x.fs, inode, false);
+	}
+	if (isdir) {
+		/* the contents of the directory go directly into outdir */
+		extract_dir(&x, argv[2], inode_n);
+	} else {
+		const char *base = strrchr(src, '/');
+		extract_inode(&x, joinpath(argv[2], base + 1), inode_n);
+	}
+
+	stream(&x);
+	finish(&x);
+	printf("%lu files, %lu directories, %llu bytes in %lu extents, %llu reads\n",
+		x.files, x.dirs, x.bytes, (unsigned long)x.exts_len, x.reads);
+
+	ext2_free(x.fs);
+	exs_free(dev);
+	if (x.z) exz_free(x.z);
+	close(x.img);
+	free(x.ents);
+	free(x.exts);
+	return 0;
+}
@@ -0,0 +1,79 @@
+/* Manages ex_overlay deltas. Not part of the library.
+ *   ./e2overlay clone base delta [block size]
+ *   ./e2overlay commit base delta
+ *   ./e2overlay discard base delta
+ *   ./e2overlay info base delta
+ * A clone is used by running ./example with EX_OVERLAY=delta on the base, which
+ * then doesn't get modified. */
+
+#include "ex_overlay.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+int
+main(int argc, char **argv)
+{
+	const char *cmd, *base_path, *delta_path;
+	int base, delta;
+	struct exo *o;
+
+	if (argc < 4) {
+		errx(1, "usage: ./e2overlay clone|commit|discard|info base delta [block size]");
+	}
+	cmd = argv[1];
+	base_path = argv[2];
+	delta_path = argv[3];
+
+	if (strcmp(cmd, "clone") == 0) {
+		uint32_t block = argc > 4 ? strtoul(argv[4], NULL, 0) : 4096;
+		struct stat st;
+		base = open(base_path, O_RDONLY);
+		if (base < 0 || fstat(base, &st) < 0) errx(1, "couldn't open %s", base_path);
+		/* fall back to smaller blocks for odd sized images */
+		while (block > 512 && st.st_size % block != 0) {
+			block /= 2;
+		}
+		delta = open(delta_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (delta < 0) errx(1, "couldn't create %s", delta_path);
+		if (exo_create(delta, st.st_size, block) < 0) {
+			unlink(delta_path);
+			errx(1, "%s can't be split into %u byte blocks", base_path, block);
+		}
+		close(delta);
+		close(base);
+		return 0;
+	}
+
+	base = open(base_path, strcmp(cmd, "commit") == 0 ? O_RDWR : O_RDONLY);
+	if (base < 0) errx(1, "couldn't open %s", base_path);
+	delta = open(delta_path, O_RDWR);
+	if (delta < 0) errx(1, "couldn't open %s", delta_path);
+	o = exo_open(base, delta);
+	if (!o) errx(1, "%s isn't a delta of %s", delta_path, base_path);
+
+	if (strcmp(cmd, "commit") == 0) {
+		if (exo_commit(o) < 0) errx(1, "commit failed");
+	} else if (strcmp(cmd, "discard") == 0) {
+		if (exo_discard(o) < 0) errx(1, "discard failed");
+	} else if (strcmp(cmd, "info") == 0) {
+		printf("block size\t%u\n", exo_block(o));
+		printf("blocks\t%llu\n", (unsigned long long)exo_mapped(o));
+		printf("bytes\t%llu\n", (unsigned long long)exo_mapped(o) * exo_block(o));
+	} else {
+		errx(1, "unknown command '%s'", cmd);
+	}
+	exo_free(o);
+	close(delta);
+	close(base);
+	return 0;
+}
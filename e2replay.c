@@ -0,0 +1,179 @@
+/* Replays a trace recorded by ex_record against one of the example caches.
+ * Not part of the library.
+ *
+ * The cache sits on top of a simulated disk, which only keeps statistics:
+ * every access costs a seek unless it starts where the previous one ended,
+ * plus the transfer time. A request counts as a hit if the cache didn't
+ * read anything from the disk to serve it.
+ * ex_cache only allows a single active request, so it can only replay traces
+ * of single threaded workloads. */
+
+#include "ex_cache.h"
+#include "ex_record.h"
+#include "ex_shcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+struct disk {
+	double seek_us, us_per_byte;
+	uint64_t pos; /* where the head is */
+	unsigned long reads, writes, seeks;
+	unsigned long long rbytes, wbytes;
+	double busy_us;
+};
+
+static int disk_access(struct disk *d, size_t len, size_t off);
+static int disk_read(void *userdata, void *buf, size_t len, size_t off);
+static int disk_write(void *userdata, const void *buf, size_t len, size_t off);
+
+static int
+disk_access(struct disk *d, size_t len, size_t off)
+{
+	if (off != d->pos) {
+		d->seeks++;
+		d->busy_us += d->seek_us;
+	}
+	d->busy_us += len * d->us_per_byte;
+	d->pos = off + len;
+	return 0;
+}
+
+static int
+disk_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	struct disk *d = userdata;
+	memset(buf, 0, len);
+	d->reads++;
+	d->rbytes += len;
+	return disk_access(d, len, off);
+}
+
+static int
+disk_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	struct disk *d = userdata;
+	(void)buf;
+	d->writes++;
+	d->wbytes += len;
+	return disk_access(d, len, off);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *cache = "exs";
+	size_t shards = 16, shard_bytes = 1 << 20, chunk = 1 << 16;
+	struct disk d = {0};
+	double seek_ms = 8, mbps = 150;
+	struct e2device *dev;
+	void **ptrs = NULL;
+	size_t ptrs_len = 0;
+	unsigned long reqs = 0, hits = 0, drops = 0, failed = 0, skipped = 0;
+	unsigned long long trace_us = 0;
+	struct exr_rec r;
+	char magic[4];
+	FILE *f;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:s:m:k:S:B:")) != -1) {
+		switch (opt) {
+		case 'c': cache = optarg; break;
+		case 's': shards = strtoul(optarg, NULL, 0); break;
+		case 'm': shard_bytes = strtoul(optarg, NULL, 0); break;
+		case 'k': chunk = strtoul(optarg, NULL, 0); break;
+		case 'S': seek_ms = atof(optarg); break;
+		case 'B': mbps = atof(optarg); break;
+		default:
+			errx(1, "usage: ./e2replay [-c exc|exs] [-s shards] [-m shard bytes] "
+				"[-k chunk] [-S seek ms] [-B MB/s] trace");
+		}
+	}
+	if (optind >= argc) errx(1, "no trace given");
+	d.seek_us = seek_ms * 1000;
+	d.us_per_byte = 1 / mbps;
+
+	f = fopen(argv[optind], "rb");
+	if (!f) errx(1, "couldn't open %s", argv[optind]);
+	if (fread(magic, 4, 1, f) != 1 || memcmp(magic, EXR_MAGIC, 4) != 0) {
+		errx(1, "%s isn't a trace", argv[optind]);
+	}
+
+	if (strcmp(cache, "exc") == 0) {
+		dev = exc_init(disk_read, disk_write, &d);
+	} else if (strcmp(cache, "exs") == 0) {
+		dev = exs_init(disk_read, disk_write, &d, shards, shard_bytes, chunk);
+	} else {
+		errx(1, "unknown cache %s", cache);
+	}
+	if (!dev) errx(1, "couldn't initialize the cache");
+
+	while (fread(&r, sizeof r, 1, f) == 1) {
+		trace_us += r.dt;
+		if (r.type == ExrReq || r.type == ExrReqh) {
+			unsigned long before = d.reads;
+			void *p;
+			if (r.id >= ptrs_len) {
+				size_t len = ptrs_len ? ptrs_len : 1024;
+				while (len <= r.id) len *= 2;
+				ptrs = realloc(ptrs, len * sizeof *ptrs);
+				if (!ptrs) errx(1, "out of memory");
+				memset(ptrs + ptrs_len, 0, (len - ptrs_len) * sizeof *ptrs);
+				ptrs_len = len;
+			}
+			if (strcmp(cache, "exs") == 0) {
+				/* unhinted requests behave like plain exs_req */
+				p = exs_reqh(dev, r.len, r.off, r.type == ExrReqh ? r.hint : E2HintReuse);
+			} else {
+				p = exc_req(dev, r.len, r.off);
+			}
+			reqs++;
+			if (!p) {
+				failed++;
+				continue;
+			}
+			if (d.reads == before) hits++;
+			ptrs[r.id] = p;
+		} else if (r.type == ExrDrop) {
+			if (r.id >= ptrs_len || !ptrs[r.id]) {
+				skipped++; /* its request failed, or wasn't recorded */
+				continue;
+			}
+			if (strcmp(cache, "exs") == 0) {
+				exs_drop(dev, ptrs[r.id], r.dirty);
+			} else {
+				exc_drop(dev, ptrs[r.id], r.dirty);
+			}
+			ptrs[r.id] = NULL;
+			drops++;
+		}
+	}
+	fclose(f);
+	/* write back whatever is still dirty, so it gets accounted for */
+	if (strcmp(cache, "exs") == 0) {
+		exs_free(dev);
+	} else {
+		exc_free(dev);
+	}
+
+	printf("requests\t%lu\n", reqs);
+	printf("drops\t%lu\n", drops);
+	printf("failed\t%lu\n", failed + skipped);
+	printf("hit_rate\t%.4f\n", reqs ? (double)hits / reqs : 0);
+	printf("disk_reads\t%lu\n", d.reads);
+	printf("disk_writes\t%lu\n", d.writes);
+	printf("disk_seeks\t%lu\n", d.seeks);
+	printf("bytes_read\t%llu\n", d.rbytes);
+	printf("bytes_written\t%llu\n", d.wbytes);
+	printf("disk_ms\t%.3f\n", d.busy_us / 1000);
+	printf("trace_ms\t%.3f\n", trace_us / 1000.0);
+	free(ptrs);
+	return 0;
+}
@@ -0,0 +1,66 @@
+/* Converts images to and from the ex_zimage format. Not part of the library.
+ *   ./e2zip [-k chunk] [-l level] image out.e2z
+ *   ./e2zip -d in.e2z image
+ * e2check and e2extract read compressed images directly. */
+
+#include "ex_zimage.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define errx(ret, ...) do { \
+	fprintf(stderr, __VA_ARGS__); \
+	fprintf(stderr, "\n"); \
+	exit(ret); \
+} while(0)
+
+int
+main(int argc, char **argv)
+{
+	uint32_t chunk = 1 << 16;
+	int level = 6;
+	int unpack = 0;
+	int in, out, opt;
+
+	while ((opt = getopt(argc, argv, "k:l:d")) != -1) {
+		switch (opt) {
+		case 'k': chunk = strtoul(optarg, NULL, 0); break;
+		case 'l': level = atoi(optarg); break;
+		case 'd': unpack = 1; break;
+		default:
+			errx(1, "usage: ./e2zip [-k chunk] [-l level] image out.e2z\n"
+				"       ./e2zip -d in.e2z image");
+		}
+	}
+	if (argc - optind < 2) errx(1, "no input or output given");
+
+	in = open(argv[optind], O_RDONLY);
+	if (in < 0) errx(1, "couldn't open %s", argv[optind]);
+	out = open(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) errx(1, "couldn't create %s", argv[optind + 1]);
+
+	if (!unpack) {
+		if (exz_pack(in, out, chunk, level) < 0) {
+			errx(1, "couldn't convert %s (is %u a power of 2?)", argv[optind], chunk);
+		}
+	} else {
+		struct exz *z = exz_open(in, 1);
+		char *buf = malloc(1 << 20);
+		uint64_t size;
+		if (!z) errx(1, "%s isn't a compressed image", argv[optind]);
+		if (!buf) errx(1, "out of memory");
+		size = exz_size(z);
+		for (uint64_t off = 0; off < size; off += 1 << 20) {
+			size_t len = size - off < 1 << 20 ? size - off : 1 << 20;
+			if (exz_read(z, buf, len, off) < 0) errx(1, "couldn't read %s", argv[optind]);
+			if (pwrite(out, buf, len, off) != (ssize_t)len) errx(1, "couldn't write %s", argv[optind + 1]);
+		}
+		free(buf);
+		exz_free(z);
+	}
+	close(out);
+	close(in);
+	return 0;
+}
@@ -0,0 +1,362 @@
+/* A copy-on-write overlay, for cloning images. Not part of the library.
+ *
+ * Delta file layout, in host byte order:
+ *   0         struct header
+ *   HDR_LEN   the map, a bit per block, set if the block is in the delta
+ *   data_off  the blocks, at data_off + block * block size, mostly a hole */
+
+#include "ex_overlay.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HDR_LEN 4096
+#define COPY_LEN (1 << 20) /* bytes per step of exo_commit */
+
+struct header {
+	char magic[4];
+	uint32_t block;
+	uint64_t size; /* of the base */
+};
+
+struct exo {
+	int base, delta;
+	uint32_t block;
+	uint64_t size, blocks;
+	uint64_t data_off;
+
+	pthread_mutex_t lock; /* protects everything below */
+	uint8_t *map;
+	size_t map_len;
+	size_t dirty_lo, dirty_hi; /* the part of the map that wasn't written yet */
+	uint64_t mapped;
+};
+
+static uint64_t data_offset(uint32_t block, uint64_t blocks);
+static int full_pread(int fd, void *buf, size_t len, uint64_t off);
+static int full_pwrite(int fd, const void *buf, size_t len, uint64_t off);
+static uint64_t run(struct exo *o, uint64_t b, uint64_t end, bool *in_delta);
+static void mark(struct exo *o, uint64_t b, uint64_t count);
+
+static uint64_t
+data_offset(uint32_t block, uint64_t blocks)
+{
+	uint64_t off = HDR_LEN + (blocks + 7) / 8;
+	return (off + block - 1) / block * block;
+}
+
+static int
+full_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+full_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Returns the end of the run of blocks starting at b (but before end) that
+ * are all either in the delta or not. */
+static uint64_t
+run(struct exo *o, uint64_t b, uint64_t end, bool *in_delta)
+{
+	pthread_mutex_lock(&o->lock);
+	*in_delta = o->map[b / 8] >> (b % 8) & 1;
+	for (b++; b < end; b++) {
+		if ((o->map[b / 8] >> (b % 8) & 1) != *in_delta) break;
+	}
+	pthread_mutex_unlock(&o->lock);
+	return b;
+}
+
+/* Must be called after the blocks were written to the delta. */
+static void
+mark(struct exo *o, uint64_t b, uint64_t count)
+{
+	pthread_mutex_lock(&o->lock);
+	for (uint64_t i = b; i < b + count; i++) {
+		if (!(o->map[i / 8] >> (i % 8) & 1)) {
+			o->map[i / 8] |= 1 << (i % 8);
+			o->mapped++;
+		}
+	}
+	if (o->dirty_lo > b / 8) {
+		o->dirty_lo = b / 8;
+	}
+	if (o->dirty_hi < (b + count - 1) / 8 + 1) {
+		o->dirty_hi = (b + count - 1) / 8 + 1;
+	}
+	pthread_mutex_unlock(&o->lock);
+}
+
+int
+exo_create(int delta_fd, uint64_t size, uint32_t block)
+{
+	struct header h = {.block = block, .size = size};
+	uint64_t data_off;
+	if (block == 0 || size % block != 0) {
+		return -1;
+	}
+	memcpy(h.magic, EXO_MAGIC, 4);
+	data_off = data_offset(block, size / block);
+	/* everything past the header is a hole */
+	if (ftruncate(delta_fd, 0) < 0 || ftruncate(delta_fd, data_off + size) < 0) {
+		return -1;
+	}
+	if (full_pwrite(delta_fd, &h, sizeof h, 0) < 0 || fsync(delta_fd) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+struct exo *
+exo_open(int base_fd, int delta_fd)
+{
+	struct header h;
+	struct stat st;
+	struct exo *o;
+	if (full_pread(delta_fd, &h, sizeof h, 0) < 0 || memcmp(h.magic, EXO_MAGIC, 4) != 0) {
+		return NULL;
+	}
+	if (fstat(base_fd, &st) < 0 || (uint64_t)st.st_size != h.size) {
+		return NULL;
+	}
+	if (h.block == 0 || h.size % h.block != 0) {
+		return NULL;
+	}
+	o = calloc(1, sizeof *o);
+	if (!o) return NULL;
+	o->base = base_fd;
+	o->delta = delta_fd;
+	o->block = h.block;
+	o->size = h.size;
+	o->blocks = h.size / h.block;
+	o->data_off = data_offset(o->block, o->blocks);
+	o->map_len = (o->blocks + 7) / 8;
+	o->map = calloc(o->map_len ? o->map_len : 1, 1);
+	if (!o->map || full_pread(delta_fd, o->map, o->map_len, HDR_LEN) < 0) {
+		free(o->map);
+		free(o);
+		return NULL;
+	}
+	for (size_t i = 0; i < o->map_len; i++) {
+		for (uint8_t bits = o->map[i]; bits; bits &= bits - 1) {
+			o->mapped++;
+		}
+	}
+	o->dirty_lo = o->map_len;
+	o->dirty_hi = 0;
+	pthread_mutex_init(&o->lock, NULL);
+	return o;
+}
+
+void
+exo_free(struct exo *o)
+{
+	if (exo_sync(o) < 0) {
+		fprintf(stderr, "exo_free: couldn't sync the delta\n");
+	}
+	pthread_mutex_destroy(&o->lock);
+	free(o->map);
+	free(o);
+}
+
+int
+exo_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	struct exo *o = userdata;
+	char *p = buf;
+	uint64_t end;
+	if (off + len > o->size) {
+		return -1;
+	}
+	end = (off + len + o->block - 1) / o->block;
+	while (len > 0) {
+		bool in_delta;
+		uint64_t next = run(o, off / o->block, end, &in_delta);
+		size_t n = next * o->block - off;
+		if (n > len) n = len;
+		if (in_delta) {
+			if (full_pread(o->delta, p, n, o->data_off + off) < 0) return -1;
+		} else {
+			if (full_pread(o->base, p, n, off) < 0) return -1;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+exo_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	struct exo *o = userdata;
+	const char *p = buf;
+	if (off + len > o->size) {
+		return -1;
+	}
+	while (len > 0) {
+		uint64_t b = off / o->block;
+		size_t in = off % o->block;
+		size_t n;
+		bool in_delta;
+		if (in == 0 && len >= o->block) {
+			/* whole blocks can go straight to the delta */
+			n = len / o->block * o->block;
+			if (full_pwrite(o->delta, p, n, o->data_off + off) < 0) return -1;
+			mark(o, b, n / o->block);
+		} else {
+			n = o->block - in < len ? o->block - in : len;
+			run(o, b, b + 1, &in_delta);
+			if (in_delta) {
+				if (full_pwrite(o->delta, p, n, o->data_off + off) < 0) return -1;
+			} else {
+				/* the rest of the block comes from the base */
+				char *tmp = malloc(o->block);
+				int ret = -1;
+				if (!tmp) return -1;
+				if (full_pread(o->base, tmp, o->block, b * o->block) == 0) {
+					memcpy(tmp + in, p, n);
+					ret = full_pwrite(o->delta, tmp, o->block, o->data_off + b * o->block);
+				}
+				free(tmp);
+				if (ret < 0) return -1;
+				mark(o, b, 1);
+			}
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+exo_sync(struct exo *o)
+{
+	size_t lo, hi;
+	uint8_t *snap = NULL;
+	int ret = 0;
+	/* Blocks only get marked after their data was written, so syncing after
+	 * taking the snapshot makes sure the map never points at missing data. */
+	pthread_mutex_lock(&o->lock);
+	lo = o->dirty_lo;
+	hi = o->dirty_hi;
+	if (lo < hi) {
+		snap = malloc(hi - lo);
+		if (snap) {
+			memcpy(snap, o->map + lo, hi - lo);
+			o->dirty_lo = o->map_len;
+			o->dirty_hi = 0;
+		}
+	}
+	pthread_mutex_unlock(&o->lock);
+	if (lo < hi && !snap) {
+		return -1;
+	}
+	if (fdatasync(o->delta) < 0) {
+		ret = -1;
+	} else if (snap && (full_pwrite(o->delta, snap, hi - lo, HDR_LEN + lo) < 0 || fdatasync(o->delta) < 0)) {
+		ret = -1;
+	}
+	if (ret < 0 && snap) {
+		/* try again next time */
+		pthread_mutex_lock(&o->lock);
+		if (o->dirty_lo > lo) o->dirty_lo = lo;
+		if (o->dirty_hi < hi) o->dirty_hi = hi;
+		pthread_mutex_unlock(&o->lock);
+	}
+	free(snap);
+	return ret;
+}
+
+int
+exo_commit(struct exo *o)
+{
+	char *buf = malloc(COPY_LEN);
+	uint64_t b = 0;
+	if (!buf) return -1;
+	while (b < o->blocks) {
+		bool in_delta;
+		uint64_t next = run(o, b, o->blocks, &in_delta);
+		if (in_delta) {
+			uint64_t off = b * o->block, end = next * o->block;
+			while (off < end) {
+				size_t n = end - off < COPY_LEN ? end - off : COPY_LEN;
+				if (full_pread(o->delta, buf, n, o->data_off + off) < 0
+						|| full_pwrite(o->base, buf, n, off) < 0) {
+					free(buf);
+					return -1;
+				}
+				off += n;
+			}
+		}
+		b = next;
+	}
+	free(buf);
+	if (fsync(o->base) < 0) {
+		return -1;
+	}
+	return exo_discard(o);
+}
+
+int
+exo_discard(struct exo *o)
+{
+	pthread_mutex_lock(&o->lock);
+	memset(o->map, 0, o->map_len);
+	o->mapped = 0;
+	o->dirty_lo = 0;
+	o->dirty_hi = o->map_len;
+	pthread_mutex_unlock(&o->lock);
+	if (exo_sync(o) < 0) {
+		return -1;
+	}
+	/* the map is empty on disk, now give the space back */
+	if (ftruncate(o->delta, o->data_off) < 0 || ftruncate(o->delta, o->data_off + o->size) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t
+exo_mapped(struct exo *o)
+{
+	uint64_t n;
+	pthread_mutex_lock(&o->lock);
+	n = o->mapped;
+	pthread_mutex_unlock(&o->lock);
+	return n;
+}
+
+uint32_t
+exo_block(struct exo *o)
+{
+	return o->block;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "ex_cache.h"
+#include <stdint.h>
+
+/* Copy-on-write overlay over a read-only base image.
+ * Writes go to a delta file instead of the base, reads come from the delta
+ * for the blocks it has and from the base for everything else. The delta
+ * starts out as a header, a bitmap of the blocks it has and a hole the size of
+ * the base, so cloning an image takes constant time and space no matter how
+ * big it is, and each clone only grows by the blocks written to it.
+ * The overlay's blocks don't have to match the filesystem's. Writes that only
+ * cover a part of a block copy the rest from the base first.
+ *
+ * exo_read and exo_write go underneath one of the caches (with the exo as the
+ * userdata), so dirty drops end up in the delta once the cache writes them
+ * back. They're thread-safe, as long as nothing writes to the same overlay
+ * block concurrently, which ex_shcache guarantees if the block is no bigger
+ * than its chunks. */
+#define EXO_MAGIC "E2OV"
+
+struct exo;
+
+/** Initializes delta_fd as an empty delta for a base of size bytes.
+ * 0 on success, -1 on failure. */
+int exo_create(int delta_fd, uint64_t size, uint32_t block);
+/** NULL if the delta doesn't belong to a base of this size. */
+struct exo *exo_open(int base_fd, int delta_fd);
+/** Syncs the map, and closes neither file. */
+void exo_free(struct exo *o);
+int exo_read(void *userdata, void *buf, size_t len, size_t off);
+int exo_write(void *userdata, const void *buf, size_t len, size_t off);
+/** Makes the delta durable: its data first, then the map. */
+int exo_sync(struct exo *o);
+/** Copies the delta into the base, which must have been opened for writing,
+ * and then discards it. */
+int exo_commit(struct exo *o);
+/** Empties the delta, so the overlay reads like the base again.
+ * Whatever is caching the overlay has to be flushed (for commits) or thrown
+ * away (for discards) first. */
+int exo_discard(struct exo *o);
+/** Number of blocks held by the delta. */
+uint64_t exo_mapped(struct exo *o);
+uint32_t exo_block(struct exo *o);
@@ -0,0 +1,164 @@
+/* A recording req/drop wrapper, see e2replay for the other side.
+ * Not part of the library. */
+
+#include "ex_record.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct active {
+	void *ptr;
+	uint32_t id;
+	uint32_t len;
+	uint64_t off;
+};
+
+struct e2device {
+	struct e2device *inner;
+	e2device_req req_fn;
+	e2device_reqh reqh_fn;
+	e2device_drop drop_fn;
+	FILE *out;
+
+	pthread_mutex_t lock;
+	uint32_t next_id;
+	struct timespec start;
+	uint64_t last_us; /* time of the last record, since start */
+	/* requests that weren't dropped yet, to pair them with their drops */
+	struct active *active;
+	size_t len, cap;
+	bool err;
+};
+
+static void emit(struct e2device *dev, struct exr_rec *r);
+static void *record_req(struct e2device *dev, void *ptr, enum exr_type type, unsigned hint, size_t len, size_t off);
+
+struct e2device *
+exr_init(struct e2device *inner, e2device_req req_fn, e2device_reqh reqh_fn,
+		e2device_drop drop_fn, FILE *out)
+{
+	struct e2device *dev = calloc(1, sizeof *dev);
+	if (!dev) return NULL;
+	dev->inner = inner;
+	dev->req_fn = req_fn;
+	dev->reqh_fn = reqh_fn;
+	dev->drop_fn = drop_fn;
+	dev->out = out;
+	pthread_mutex_init(&dev->lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &dev->start);
+	if (fwrite(EXR_MAGIC, 4, 1, out) != 1) {
+		dev->err = true;
+	}
+	return dev;
+}
+
+void
+exr_free(struct e2device *dev)
+{
+	if (fflush(dev->out) != 0 || dev->err) {
+		fprintf(stderr, "exr_free: the trace is incomplete\n");
+	}
+	pthread_mutex_destroy(&dev->lock);
+	free(dev->active);
+	free(dev);
+}
+
+/* Must be called with the lock held. */
+static void
+emit(struct e2device *dev, struct exr_rec *r)
+{
+	struct timespec now;
+	uint64_t us;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - dev->start.tv_sec) * 1000000
+		+ (now.tv_nsec - dev->start.tv_nsec) / 1000;
+	r->dt = us - dev->last_us > UINT32_MAX ? UINT32_MAX : us - dev->last_us;
+	r->_pad = 0;
+	dev->last_us = us;
+	if (fwrite(r, sizeof *r, 1, dev->out) != 1) {
+		dev->err = true;
+	}
+}
+
+static void *
+record_req(struct e2device *dev, void *ptr, enum exr_type type, unsigned hint, size_t len, size_t off)
+{
+	struct exr_rec r = {
+		.type = ptr ? type : ExrFail,
+		.hint = hint,
+		.dirty = 0,
+		.len = len,
+		.off = off,
+	};
+	pthread_mutex_lock(&dev->lock);
+	r.id = dev->next_id++;
+	if (ptr) {
+		if (dev->len == dev->cap) {
+			size_t cap = dev->cap ? dev->cap * 2 : 16;
+			struct active *a = realloc(dev->active, cap * sizeof *a);
+			if (a) {
+				dev->active = a;
+				dev->cap = cap;
+			}
+		}
+		if (dev->len < dev->cap) {
+			dev->active[dev->len].ptr = ptr;
+			dev->active[dev->len].id = r.id;
+			dev->active[dev->len].len = len;
+			dev->active[dev->len].off = off;
+			dev->len++;
+		} else {
+			dev->err = true;
+		}
+	}
+	emit(dev, &r);
+	pthread_mutex_unlock(&dev->lock);
+	return ptr;
+}
+
+void *
+exr_req(struct e2device *dev, size_t len, size_t off)
+{
+	void *p = dev->req_fn(dev->inner, len, off);
+	return record_req(dev, p, ExrReq, 0, len, off);
+}
+
+void *
+exr_reqh(struct e2device *dev, size_t len, size_t off, unsigned hint)
+{
+	void *p;
+	if (!dev->reqh_fn) {
+		p = dev->req_fn(dev->inner, len, off);
+		return record_req(dev, p, ExrReq, 0, len, off);
+	}
+	p = dev->reqh_fn(dev->inner, len, off, hint);
+	return record_req(dev, p, ExrReqh, hint, len, off);
+}
+
+int
+exr_drop(struct e2device *dev, void *ptr, bool dirty)
+{
+	struct exr_rec r = {
+		.type = ExrDrop,
+		.hint = 0,
+		.dirty = dirty,
+		.id = UINT32_MAX,
+		.len = 0,
+		.off = 0,
+	};
+	pthread_mutex_lock(&dev->lock);
+	/* overlapping requests can share a pointer, take the newest one */
+	for (size_t i = dev->len; i-- > 0; ) {
+		if (dev->active[i].ptr == ptr) {
+			r.id = dev->active[i].id;
+			r.len = dev->active[i].len;
+			r.off = dev->active[i].off;
+			memmove(&dev->active[i], &dev->active[i + 1], (--dev->len - i) * sizeof *dev->active);
+			break;
+		}
+	}
+	emit(dev, &r);
+	pthread_mutex_unlock(&dev->lock);
+	return dev->drop_fn(dev->inner, ptr, dirty);
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "ext2.h"
+#include <stdio.h>
+
+/* Trace file format: the 4 byte magic, followed by struct exr_rec records,
+ * all in host byte order. */
+#define EXR_MAGIC "E2TR"
+
+enum exr_type {
+	ExrReq, /* made through plain req, hint is unknown */
+	ExrReqh, /* made through reqh */
+	ExrDrop,
+	ExrFail, /* a request that returned NULL */
+};
+
+struct exr_rec {
+	uint8_t type;
+	uint8_t hint;
+	uint8_t dirty;
+	uint8_t _pad;
+	uint32_t id; /* of the request, drops carry the id of theirs */
+	uint32_t dt; /* microseconds since the previous record */
+	uint32_t len;
+	uint64_t off;
+} __attribute__((__packed__));
+
+/* Wraps another device, logging every request and drop to out. reqh_fn may
+ * be NULL, then exr_reqh falls back to req_fn. The inner device isn't freed by
+ * exr_free. Thread-safe if the inner device is. */
+struct e2device *exr_init(struct e2device *inner, e2device_req req_fn, e2device_reqh reqh_fn,
+		e2device_drop drop_fn, FILE *out);
+void exr_free(struct e2device *dev);
+void *exr_req(struct e2device *dev, size_t len, size_t off);
+void *exr_reqh(struct e2device *dev, size_t len, size_t off, unsigned hint);
+int exr_drop(struct e2device *dev, void *ptr, bool dirty);
@@ -0,0 +1,684 @@
+/* A sharded, thread-safe caching req/drop implementation.
+ * Like ex_cache, it isn't part of the library.
+ *
+ * The device is split into chunk sized pieces, which get spread over the
+ * shards by a hash of their offset. Each shard has its own lock, LRU and
+ * a fixed amount of slots, so threads working on different parts of the
+ * device don't contend with each other.
+ * All the slots live in a single arena, so exs_drop can find the slot (and
+ * its shard) from just the pointer.
+ *
+ * The shards, slots and arena make up a pool, which any number of devices
+ * can be attached to. Chunks are keyed by their device and offset, and all the
+ * devices compete for the same slots, so the pool's size is a budget for all
+ * of them together, and the busy ones take their slots from the idle ones.
+ * exs_init makes a device with a pool of its own.
+ *
+ * Unlike ex_cache, this one is write-back. Writing a chunk through while
+ * another thread is modifying a different block within it would race, so
+ * dirty chunks only get written once nobody's using them - on eviction,
+ * or by exs_sync.
+ *
+ * With exs_reqh, chunks that were only requested without E2HintReuse go to
+ * the cold end of the LRU once dropped, so streaming through file data
+ * doesn't evict the metadata.
+ *
+ * exs_reqa never reads the device itself. Misses get queued for the pool's
+ * loader threads, which read the chunk into the cache like exs_reqh would,
+ * drop it again, and wake the op waiting for it through the callback given to
+ * exs_pool_loaders. */
+
+#include "ex_shcache.h"
+#include "ext2.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE ((uint32_t)-1)
+
+struct slot {
+	struct e2device *dev; /* the owner, if valid */
+	size_t start; /* offset of the chunk on the device */
+	uint32_t refs;
+	bool valid, dirty;
+	bool cold; /* nobody asked to keep it cached */
+	uint32_t hnext; /* hash chain, or the free list */
+	uint32_t lprev, lnext; /* LRU list, only if refs == 0 */
+};
+
+struct dirty {
+	size_t start;
+	uint32_t idx;
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	uint32_t *buckets;
+	uint32_t first, last; /* LRU, first is the most recently used */
+	uint32_t free; /* empty slots, chained through hnext */
+	struct {
+		unsigned long hit, miss, evict;
+	} stats;
+} __attribute__((aligned(64)));
+
+/* a miss of exs_reqa, waiting for a loader */
+struct load {
+	struct e2device *dev;
+	size_t len, off;
+	unsigned hint;
+	struct ext2_aop *op;
+	struct load *next;
+};
+
+struct exs_pool {
+	size_t chunk;
+	uint32_t shard_amt, slots_per_shard, buckets_per_shard;
+	struct shard *shards;
+	struct slot *slots;
+	char *arena;
+	uint64_t next_id;
+	uint32_t devices; /* attached */
+
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct load *first, *last;
+		pthread_t *threads;
+		size_t threads_len;
+		exs_wake wake;
+		bool stop;
+	} loads;
+};
+
+struct e2device {
+	struct exs_pool *pool;
+	bool own_pool; /* made by exs_init */
+	uint64_t id; /* mixed into the hash, so devices don't all collide */
+	exc_read read_fn;
+	exc_write write_fn;
+	void *userdata;
+};
+
+static void *alloc_aligned(size_t align, size_t len);
+static uint64_t hash(struct e2device *dev, size_t start);
+static uint32_t bucket_of(struct exs_pool *p, uint32_t idx);
+static void lru_remove(struct exs_pool *p, struct shard *sh, uint32_t idx);
+static void lru_push(struct exs_pool *p, struct shard *sh, uint32_t idx);
+static void lru_push_cold(struct exs_pool *p, struct shard *sh, uint32_t idx);
+static void hash_remove(struct exs_pool *p, struct shard *sh, uint32_t idx);
+static uint32_t take_slot(struct exs_pool *p, struct shard *sh);
+static int writeback(struct exs_pool *p, uint32_t idx);
+static int write_chunk(struct exs_pool *p, uint32_t idx);
+static int dirty_cmp(const void *a, const void *b);
+static void unref(struct exs_pool *p, struct shard *sh, uint32_t idx);
+static int flush(struct e2device *dev, bool forget);
+static void *req(struct e2device *dev, size_t len, size_t off, unsigned hint, bool wait);
+static void *loader(void *arg);
+static size_t chunk_left(struct exs_pool *p, size_t off);
+
+/* aligned_alloc is C11, this builds with c99 */
+static void *
+alloc_aligned(size_t align, size_t len)
+{
+	void *p;
+	if (align < sizeof(void*)) align = sizeof(void*);
+	return posix_memalign(&p, align, len) == 0 ? p : NULL;
+}
+
+static uint64_t
+hash(struct e2device *dev, size_t start)
+{
+	uint64_t x = start / dev->pool->chunk + dev->id * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint32_t
+bucket_of(struct exs_pool *p, uint32_t idx)
+{
+	return (hash(p->slots[idx].dev, p->slots[idx].start) >> 32) % p->buckets_per_shard;
+}
+
+struct exs_pool *
+exs_pool_init(size_t shards, size_t shard_bytes, size_t chunk)
+{
+	struct exs_pool *p;
+	size_t slots;
+	if (shards == 0 || (shards & (shards - 1)) != 0) return NULL;
+	if (chunk == 0 || (chunk & (chunk - 1)) != 0) return NULL;
+	if (shard_bytes / chunk == 0) return NULL;
+
+	p = calloc(1, sizeof *p);
+	if (!p) {
+		return NULL;
+	}
+	pthread_mutex_init(&p->loads.lock, NULL);
+	pthread_cond_init(&p->loads.cond, NULL);
+	p->chunk = chunk;
+	p->shard_amt = shards;
+	p->slots_per_shard = shard_bytes / chunk;
+	p->buckets_per_shard = p->slots_per_shard * 2;
+
+	slots = (size_t)p->shard_amt * p->slots_per_shard;
+	p->shards = alloc_aligned(64, shards * sizeof *p->shards);
+	p->slots = calloc(slots, sizeof *p->slots);
+	/* the pages only get touched once the slots get filled */
+	p->arena = alloc_aligned(chunk, slots * chunk);
+	if (!p->shards || !p->slots || !p->arena) {
+		free(p->shards);
+		free(p->slots);
+		free(p->arena);
+		free(p);
+		return NULL;
+	}
+	for (uint32_t s = 0; s < p->shard_amt; s++) {
+		struct shard *sh = &p->shards[s];
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->buckets = malloc(p->buckets_per_shard * sizeof *sh->buckets);
+		if (!sh->buckets) {
+			p->shard_amt = s;
+			exs_pool_free(p);
+			return NULL;
+		}
+		for (uint32_t i = 0; i < p->buckets_per_shard; i++) {
+			sh->buckets[i] = NONE;
+		}
+		sh->first = sh->last = NONE;
+		sh->free = NONE;
+		for (uint32_t i = 0; i < p->slots_per_shard; i++) {
+			uint32_t idx = s * p->slots_per_shard + i;
+			p->slots[idx].hnext = sh->free;
+			sh->free = idx;
+		}
+		sh->stats.hit = sh->stats.miss = sh->stats.evict = 0;
+	}
+	return p;
+}
+
+void
+exs_pool_free(struct exs_pool *p)
+{
+	unsigned long hit = 0, miss = 0, evict = 0;
+	pthread_mutex_lock(&p->loads.lock);
+	p->loads.stop = true;
+	pthread_cond_broadcast(&p->loads.cond);
+	pthread_mutex_unlock(&p->loads.lock);
+	for (size_t i = 0; i < p->loads.threads_len; i++) {
+		pthread_join(p->loads.threads[i], NULL);
+	}
+	free(p->loads.threads);
+	pthread_cond_destroy(&p->loads.cond);
+	pthread_mutex_destroy(&p->loads.lock);
+	assert(p->devices == 0 && !p->loads.first);
+	for (uint32_t s = 0; s < p->shard_amt; s++) {
+		struct shard *sh = &p->shards[s];
+		hit += sh->stats.hit;
+		miss += sh->stats.miss;
+		evict += sh->stats.evict;
+		pthread_mutex_destroy(&sh->lock);
+		free(sh->buckets);
+	}
+	fprintf(stderr, "cache hit     %7lu\n", hit);
+	fprintf(stderr, "cache miss    %7lu\n", miss);
+	fprintf(stderr, "cache evict   %7lu\n", evict);
+
+	free(p->shards);
+	free(p->slots);
+	free(p->arena);
+	free(p);
+}
+
+int
+exs_pool_loaders(struct exs_pool *p, size_t threads, exs_wake wake)
+{
+	assert(p->loads.threads_len == 0);
+	p->loads.wake = wake;
+	p->loads.threads = malloc(threads * sizeof *p->loads.threads);
+	if (!p->loads.threads) {
+		return -1;
+	}
+	for (; p->loads.threads_len < threads; p->loads.threads_len++) {
+		if (pthread_create(&p->loads.threads[p->loads.threads_len], NULL, loader, p) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void *
+loader(void *arg)
+{
+	struct exs_pool *p = arg;
+	for (;;) {
+		struct load *l;
+		void *ptr;
+		pthread_mutex_lock(&p->loads.lock);
+		while (!p->loads.first && !p->loads.stop) {
+			pthread_cond_wait(&p->loads.cond, &p->loads.lock);
+		}
+		l = p->loads.first;
+		if (!l) {
+			pthread_mutex_unlock(&p->loads.lock);
+			return NULL;
+		}
+		p->loads.first = l->next;
+		if (!p->loads.first) {
+			p->loads.last = NULL;
+		}
+		pthread_mutex_unlock(&p->loads.lock);
+
+		/* Once dropped, the chunk stays cached until it gets evicted, which
+		 * is very unlikely to happen before the op gets back to it. If it
+		 * does, the op just misses again. */
+		ptr = req(l->dev, l->len, l->off, l->hint, true);
+		if (ptr) {
+			exs_drop(l->dev, ptr, false);
+		}
+		p->loads.wake(l->op, ptr == NULL);
+		free(l);
+	}
+}
+
+struct e2device *
+exs_attach(struct exs_pool *p, exc_read read_fn, exc_write write_fn, void *userdata)
+{
+	struct e2device *dev = calloc(1, sizeof *dev);
+	if (!dev) {
+		return NULL;
+	}
+	dev->pool = p;
+	dev->id = __atomic_fetch_add(&p->next_id, 1, __ATOMIC_RELAXED);
+	dev->read_fn = read_fn;
+	dev->write_fn = write_fn;
+	dev->userdata = userdata;
+	__atomic_fetch_add(&p->devices, 1, __ATOMIC_RELAXED);
+	return dev;
+}
+
+struct e2device *
+exs_init(exc_read read_fn, exc_write write_fn, void *userdata,
+		size_t shards, size_t shard_bytes, size_t chunk)
+{
+	struct exs_pool *p = exs_pool_init(shards, shard_bytes, chunk);
+	struct e2device *dev;
+	if (!p) {
+		return NULL;
+	}
+	dev = exs_attach(p, read_fn, write_fn, userdata);
+	if (!dev) {
+		exs_pool_free(p);
+		return NULL;
+	}
+	dev->own_pool = true;
+	return dev;
+}
+
+void
+exs_free(struct e2device *dev)
+{
+	struct exs_pool *p = dev->pool;
+	if (flush(dev, true) < 0) {
+		fprintf(stderr, "exs_free: couldn't write back some chunks\n");
+	}
+	__atomic_fetch_sub(&p->devices, 1, __ATOMIC_RELAXED);
+	if (dev->own_pool) {
+		exs_pool_free(p);
+	}
+	free(dev);
+}
+
+static int
+writeback(struct exs_pool *p, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	if (!sl->dirty) return 0;
+	if (write_chunk(p, idx) < 0) {
+		return -1;
+	}
+	sl->dirty = false;
+	return 0;
+}
+
+/* Doesn't need the shard locked, as long as the slot is referenced. */
+static int
+write_chunk(struct exs_pool *p, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	return sl->dev->write_fn(sl->dev->userdata, p->arena + (size_t)idx * p->chunk, p->chunk, sl->start);
+}
+
+static int
+dirty_cmp(const void *a, const void *b)
+{
+	const struct dirty *da = a, *db = b;
+	return (da->start > db->start) - (da->start < db->start);
+}
+
+/* Writes back the device's dirty chunks, and with forget, also takes all of
+ * its chunks out of the pool. */
+static int
+flush(struct e2device *dev, bool forget)
+{
+	struct exs_pool *p = dev->pool;
+	size_t slots = (size_t)p->shard_amt * p->slots_per_shard;
+	struct dirty *list;
+	size_t len = 0;
+	int ret = 0;
+
+	/* The dirty chunks get collected one shard at a time, and referenced so
+	 * they can't be evicted. The writes happen with no shard locked, in the
+	 * order the chunks are on the device. Without the list, they're written
+	 * as they're found.
+	 * They're marked clean when collected, so a drop during the write marks
+	 * them dirty again. A failed write does the same. */
+	list = malloc(slots * sizeof *list);
+	for (uint32_t s = 0; s < p->shard_amt; s++) {
+		struct shard *sh = &p->shards[s];
+		pthread_mutex_lock(&sh->lock);
+		for (uint32_t idx = s * p->slots_per_shard; idx < (s + 1) * p->slots_per_shard; idx++) {
+			struct slot *sl = &p->slots[idx];
+			bool failed;
+			if (!sl->valid || sl->dev != dev || !sl->dirty) continue;
+			if (sl->refs++ == 0) {
+				lru_remove(p, sh, idx);
+			}
+			sl->dirty = false;
+			if (list) {
+				list[len].start = sl->start;
+				list[len].idx = idx;
+				len++;
+				continue;
+			}
+			pthread_mutex_unlock(&sh->lock);
+			failed = write_chunk(p, idx) < 0;
+			pthread_mutex_lock(&sh->lock);
+			if (failed) {
+				sl->dirty = true;
+				ret = -1;
+			}
+			unref(p, sh, idx);
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	if (list) {
+		qsort(list, len, sizeof *list, dirty_cmp);
+		for (size_t i = 0; i < len; i++) {
+			struct shard *sh = &p->shards[list[i].idx / p->slots_per_shard];
+			bool failed = write_chunk(p, list[i].idx) < 0;
+			pthread_mutex_lock(&sh->lock);
+			if (failed) {
+				p->slots[list[i].idx].dirty = true;
+				ret = -1;
+			}
+			unref(p, sh, list[i].idx);
+			pthread_mutex_unlock(&sh->lock);
+		}
+		free(list);
+	}
+
+	for (uint32_t s = 0; forget && s < p->shard_amt; s++) {
+		struct shard *sh = &p->shards[s];
+		pthread_mutex_lock(&sh->lock);
+		for (uint32_t idx = s * p->slots_per_shard; idx < (s + 1) * p->slots_per_shard; idx++) {
+			struct slot *sl = &p->slots[idx];
+			if (!sl->valid || sl->dev != dev) continue;
+			assert(sl->refs == 0);
+			lru_remove(p, sh, idx);
+			hash_remove(p, sh, idx);
+			sl->valid = false;
+			sl->dev = NULL;
+			sl->hnext = sh->free;
+			sh->free = idx;
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	return ret;
+}
+
+static size_t
+chunk_left(struct exs_pool *p, size_t off)
+{
+	return p->chunk - (off & (p->chunk - 1));
+}
+
+/* Both chunks can be active at once here, unlike within the library. */
+int
+exs_copy(struct e2device *dev, size_t dst_off, size_t src_off, size_t len)
+{
+	struct exs_pool *p = dev->pool;
+	while (len > 0) {
+		size_t n = len;
+		void *src, *dst;
+		if (n > chunk_left(p, src_off)) n = chunk_left(p, src_off);
+		if (n > chunk_left(p, dst_off)) n = chunk_left(p, dst_off);
+		src = exs_reqh(dev, n, src_off, E2HintSeq);
+		if (!src) return -1;
+		dst = exs_reqh(dev, n, dst_off, E2HintSeq);
+		if (!dst) {
+			exs_drop(dev, src, false);
+			return -1;
+		}
+		memcpy(dst, src, n);
+		exs_drop(dev, src, false);
+		exs_drop(dev, dst, true);
+		src_off += n;
+		dst_off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+exs_sync(struct e2device *dev)
+{
+	return flush(dev, false);
+}
+
+static void
+lru_remove(struct exs_pool *p, struct shard *sh, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	if (sl->lprev != NONE) p->slots[sl->lprev].lnext = sl->lnext;
+	else sh->first = sl->lnext;
+	if (sl->lnext != NONE) p->slots[sl->lnext].lprev = sl->lprev;
+	else sh->last = sl->lprev;
+}
+
+static void
+lru_push(struct exs_pool *p, struct shard *sh, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	sl->lprev = NONE;
+	sl->lnext = sh->first;
+	if (sh->first != NONE) p->slots[sh->first].lprev = idx;
+	else sh->last = idx;
+	sh->first = idx;
+}
+
+static void
+lru_push_cold(struct exs_pool *p, struct shard *sh, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	sl->lnext = NONE;
+	sl->lprev = sh->last;
+	if (sh->last != NONE) p->slots[sh->last].lnext = idx;
+	else sh->first = idx;
+	sh->last = idx;
+}
+
+static void
+hash_remove(struct exs_pool *p, struct shard *sh, uint32_t idx)
+{
+	uint32_t *b = &sh->buckets[bucket_of(p, idx)];
+	while (*b != idx) {
+		assert(*b != NONE);
+		b = &p->slots[*b].hnext;
+	}
+	*b = p->slots[idx].hnext;
+}
+
+/* Returns an empty slot, evicting the least recently used one if needed. */
+static uint32_t
+take_slot(struct exs_pool *p, struct shard *sh)
+{
+	uint32_t idx = sh->free;
+	if (idx != NONE) {
+		sh->free = p->slots[idx].hnext;
+		return idx;
+	}
+	idx = sh->last;
+	if (idx == NONE) {
+		return NONE; /* everything is in use */
+	}
+	if (writeback(p, idx) < 0) {
+		return NONE;
+	}
+	lru_remove(p, sh, idx);
+	hash_remove(p, sh, idx);
+	p->slots[idx].valid = false;
+	sh->stats.evict++;
+	return idx;
+}
+
+void *
+exs_req(struct e2device *dev, size_t len, size_t off)
+{
+	return exs_reqh(dev, len, off, E2HintReuse);
+}
+
+void *
+exs_reqh(struct e2device *dev, size_t len, size_t off, unsigned hint)
+{
+	return req(dev, len, off, hint, true);
+}
+
+void *
+exs_reqa(struct e2device *dev, size_t len, size_t off, unsigned hint, struct ext2_aop *op)
+{
+	struct exs_pool *p = dev->pool;
+	struct load *l;
+	void *ptr;
+	if (p->loads.threads_len == 0) {
+		return req(dev, len, off, hint, true);
+	}
+	ptr = req(dev, len, off, hint, false);
+	if (ptr != E2DEVICE_PENDING) {
+		return ptr;
+	}
+	l = malloc(sizeof *l);
+	if (!l) {
+		return NULL;
+	}
+	*l = (struct load){dev, len, off, hint, op, NULL};
+	pthread_mutex_lock(&p->loads.lock);
+	if (p->loads.last) {
+		p->loads.last->next = l;
+	} else {
+		p->loads.first = l;
+	}
+	p->loads.last = l;
+	pthread_cond_signal(&p->loads.cond);
+	pthread_mutex_unlock(&p->loads.lock);
+	return E2DEVICE_PENDING;
+}
+
+/* Without wait, misses return E2DEVICE_PENDING instead of reading the chunk. */
+static void *
+req(struct e2device *dev, size_t len, size_t off, unsigned hint, bool wait)
+{
+	struct exs_pool *p = dev->pool;
+	size_t start = off & ~(p->chunk - 1);
+	uint64_t h = hash(dev, start);
+	uint32_t s = h & (p->shard_amt - 1);
+	struct shard *sh = &p->shards[s];
+	uint32_t *bucket;
+	uint32_t idx;
+
+	if (len == 0 || off + len > start + p->chunk) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	bucket = &sh->buckets[(h >> 32) % p->buckets_per_shard];
+	for (idx = *bucket; idx != NONE; idx = p->slots[idx].hnext) {
+		if (p->slots[idx].start == start && p->slots[idx].dev == dev) break;
+	}
+	if (idx != NONE) {
+		struct slot *sl = &p->slots[idx];
+		if (sl->refs++ == 0) {
+			lru_remove(p, sh, idx);
+		}
+		if (hint & E2HintReuse) {
+			sl->cold = false;
+		}
+		sh->stats.hit++;
+		pthread_mutex_unlock(&sh->lock);
+		return p->arena + (size_t)idx * p->chunk + (off - start);
+	}
+
+	if (!wait) {
+		pthread_mutex_unlock(&sh->lock);
+		return E2DEVICE_PENDING;
+	}
+	/* The read happens with the shard locked, so nobody else can miss on
+	 * the same chunk in the meantime. Other shards aren't affected. */
+	sh->stats.miss++;
+	idx = take_slot(p, sh);
+	if (idx == NONE) {
+		pthread_mutex_unlock(&sh->lock);
+		return NULL;
+	}
+	if (dev->read_fn(dev->userdata, p->arena + (size_t)idx * p->chunk, p->chunk, start) < 0) {
+		p->slots[idx].hnext = sh->free;
+		sh->free = idx;
+		pthread_mutex_unlock(&sh->lock);
+		return NULL;
+	}
+	p->slots[idx].dev = dev;
+	p->slots[idx].start = start;
+	p->slots[idx].refs = 1;
+	p->slots[idx].valid = true;
+	p->slots[idx].dirty = false;
+	p->slots[idx].cold = !(hint & E2HintReuse);
+	p->slots[idx].hnext = *bucket;
+	*bucket = idx;
+	pthread_mutex_unlock(&sh->lock);
+	return p->arena + (size_t)idx * p->chunk + (off - start);
+}
+
+int
+exs_drop(struct e2device *dev, void *ptr, bool dirty)
+{
+	struct exs_pool *p = dev->pool;
+	uint32_t idx = ((char*)ptr - p->arena) / p->chunk;
+	struct shard *sh = &p->shards[idx / p->slots_per_shard];
+	struct slot *sl = &p->slots[idx];
+	assert(p->arena <= (char*)ptr && idx < p->shard_amt * p->slots_per_shard);
+	assert(sl->dev == dev);
+
+	pthread_mutex_lock(&sh->lock);
+	sl->dirty |= dirty;
+	unref(p, sh, idx);
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
+
+/* With the shard locked. */
+static void
+unref(struct exs_pool *p, struct shard *sh, uint32_t idx)
+{
+	struct slot *sl = &p->slots[idx];
+	assert(sl->refs > 0);
+	if (--sl->refs == 0) {
+		if (sl->cold) {
+			lru_push_cold(p, sh, idx);
+		} else {
+			lru_push(p, sh, idx);
+		}
+	}
+}
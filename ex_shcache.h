@@ -0,0 +1,47 @@
+#pragma once
+#include "ex_cache.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct ext2_aop;
+
+/* Thread-safe variant of ex_cache.
+ * Every request must fit within a single chunk-aligned chunk, so chunk must be
+ * a power of 2 that's at least the block size of the filesystem.
+ * shards must be a power of 2, shard_bytes / chunk chunks get cached per shard.
+ * Dirty chunks are only written on eviction, exs_sync and exs_free. */
+struct e2device *exs_init(exc_read read_fn, exc_write write_fn, void *userdata,
+		size_t shards, size_t shard_bytes, size_t chunk);
+/** Writes back the device's dirty chunks and forgets about the rest. Frees the
+ * pool too if the device came from exs_init. */
+void exs_free(struct e2device *dev);
+
+/* A pool of shards shared by many devices, with shards * shard_bytes as the
+ * budget for all of them. The least recently used chunks get evicted,
+ * whichever device they're from. */
+struct exs_pool;
+struct exs_pool *exs_pool_init(size_t shards, size_t shard_bytes, size_t chunk);
+/** All the devices must have been freed with exs_free. */
+void exs_pool_free(struct exs_pool *pool);
+/* Called by a loader once the chunk an op waited for is cached, or couldn't be
+ * read. That's ext2_aop_wake, but the pool doesn't depend on the library. */
+typedef void (*exs_wake)(struct ext2_aop *op, bool failed);
+/** Starts threads that load the chunks exs_reqa misses on, and then call wake.
+ * Call it before using exs_reqa, the threads get stopped by exs_pool_free. */
+int exs_pool_loaders(struct exs_pool *pool, size_t threads, exs_wake wake);
+/** Thread-safe. The device gets freed by exs_free. */
+struct e2device *exs_attach(struct exs_pool *pool, exc_read read_fn, exc_write write_fn, void *userdata);
+void *exs_req(struct e2device *dev, size_t len, size_t off);
+/** For ext2_setreqh. Chunks that are never requested with E2HintReuse get
+ * evicted first. */
+void *exs_reqh(struct e2device *dev, size_t len, size_t off, unsigned hint);
+/** For ext2_setreqa. Misses get loaded by the pool's loader threads, which then
+ * wake the op. Without loaders, it's exs_reqh. A device mustn't be freed while
+ * it has ops waiting. */
+void *exs_reqa(struct e2device *dev, size_t len, size_t off, unsigned hint, struct ext2_aop *op);
+int exs_drop(struct e2device *dev, void *ptr, bool dirty);
+/** For ext2_setcopy. Copies within the cache, a chunk at a time. */
+int exs_copy(struct e2device *dev, size_t dst_off, size_t src_off, size_t len);
+/** Writes back all dirty chunks, in device order. Chunks that are being modified at the same
+ * time might get written in an inconsistent state. */
+int exs_sync(struct e2device *dev);
@@ -0,0 +1,326 @@
+/* Reads and writes compressed images. Not part of the library. */
+
+#include "ex_zimage.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define HDR_LEN 16
+#define NO_CHUNK UINT64_MAX
+
+struct slot {
+	uint64_t chunk; /* NO_CHUNK if it's empty */
+	char *data;
+	unsigned refs;
+	bool ready; /* false while it's being inflated */
+	uint64_t lastuse;
+};
+
+struct exz {
+	int fd;
+	uint32_t chunk;
+	uint64_t size, chunks;
+	uint64_t *index;
+
+	pthread_mutex_t lock; /* protects the slots and stats */
+	pthread_cond_t cond; /* signaled when a slot becomes ready or unused */
+	struct slot *slots;
+	size_t slots_len;
+	uint64_t clock;
+	unsigned long hit, miss;
+};
+
+static int full_pread(int fd, void *buf, size_t len, uint64_t off);
+static int full_pwrite(int fd, const void *buf, size_t len, uint64_t off);
+static size_t chunk_len(struct exz *z, uint64_t c);
+static int inflate_chunk(struct exz *z, uint64_t c, char *out);
+static struct slot *get(struct exz *z, uint64_t c);
+static void put(struct exz *z, struct slot *s);
+
+static int
+full_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+full_pwrite(int fd, const void *buf, size_t len, uint64_t off)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Only the last chunk can be shorter. */
+static size_t
+chunk_len(struct exz *z, uint64_t c)
+{
+	uint64_t left = z->size - c * z->chunk;
+	return left < z->chunk ? left : z->chunk;
+}
+
+static int
+inflate_chunk(struct exz *z, uint64_t c, char *out)
+{
+	size_t len = chunk_len(z, c);
+	uint64_t clen = z->index[c + 1] - z->index[c];
+	uLongf outlen = len;
+	char *in;
+	int ret;
+	if (clen == 0) {
+		memset(out, 0, len);
+		return 0;
+	} else if (clen == len) {
+		return full_pread(z->fd, out, len, z->index[c]);
+	}
+	in = malloc(clen);
+	if (!in) return -1;
+	ret = full_pread(z->fd, in, clen, z->index[c]);
+	if (ret == 0 && (uncompress((Bytef*)out, &outlen, (Bytef*)in, clen) != Z_OK || outlen != len)) {
+		ret = -1;
+	}
+	free(in);
+	return ret;
+}
+
+int
+exz_pack(int in_fd, int out_fd, uint32_t chunk, int level)
+{
+	struct stat st;
+	uint64_t chunks, *index;
+	char hdr[HDR_LEN];
+	char *raw, *packed;
+	uLong bound = compressBound(chunk);
+	int ret = -1;
+	if (chunk == 0 || (chunk & (chunk - 1)) != 0 || fstat(in_fd, &st) < 0) {
+		return -1;
+	}
+	chunks = ((uint64_t)st.st_size + chunk - 1) / chunk;
+	index = malloc((chunks + 1) * sizeof *index);
+	raw = malloc(chunk);
+	packed = malloc(bound);
+	if (!index || !raw || !packed) goto out;
+
+	index[0] = HDR_LEN + (chunks + 1) * sizeof *index;
+	for (uint64_t c = 0; c < chunks; c++) {
+		uint64_t left = st.st_size - c * chunk;
+		size_t len = left < chunk ? left : chunk;
+		uLongf plen = bound;
+		bool zero = true;
+		if (full_pread(in_fd, raw, len, c * chunk) < 0) goto out;
+		for (size_t i = 0; i < len; i++) {
+			if (raw[i] != 0) {
+				zero = false;
+				break;
+			}
+		}
+		if (zero) {
+			plen = 0;
+		} else if (compress2((Bytef*)packed, &plen, (Bytef*)raw, len, level) != Z_OK || plen >= len) {
+			plen = len;
+			if (full_pwrite(out_fd, raw, len, index[c]) < 0) goto out;
+		} else {
+			if (full_pwrite(out_fd, packed, plen, index[c]) < 0) goto out;
+		}
+		index[c + 1] = index[c] + plen;
+	}
+
+	memcpy(hdr, EXZ_MAGIC, 4);
+	memcpy(hdr + 4, &chunk, 4);
+	memcpy(hdr + 8, &(uint64_t){st.st_size}, 8);
+	if (full_pwrite(out_fd, index, (chunks + 1) * sizeof *index, HDR_LEN) < 0) goto out;
+	/* written last, so an interrupted conversion isn't mistaken for an image */
+	if (full_pwrite(out_fd, hdr, HDR_LEN, 0) < 0) goto out;
+	if (ftruncate(out_fd, index[chunks]) < 0) goto out;
+	ret = 0;
+out:
+	free(index);
+	free(raw);
+	free(packed);
+	return ret;
+}
+
+struct exz *
+exz_open(int fd, size_t slots)
+{
+	char hdr[HDR_LEN];
+	struct exz *z;
+	if (full_pread(fd, hdr, HDR_LEN, 0) < 0 || memcmp(hdr, EXZ_MAGIC, 4) != 0) {
+		return NULL;
+	}
+	if (slots == 0) slots = 1;
+	z = calloc(1, sizeof *z);
+	if (!z) return NULL;
+	z->fd = fd;
+	memcpy(&z->chunk, hdr + 4, 4);
+	memcpy(&z->size, hdr + 8, 8);
+	if (z->chunk == 0 || (z->chunk & (z->chunk - 1)) != 0) {
+		free(z);
+		return NULL;
+	}
+	z->chunks = (z->size + z->chunk - 1) / z->chunk;
+	z->index = malloc((z->chunks + 1) * sizeof *z->index);
+	z->slots = calloc(slots, sizeof *z->slots);
+	if (!z->index || !z->slots
+			|| full_pread(fd, z->index, (z->chunks + 1) * sizeof *z->index, HDR_LEN) < 0) {
+		goto fail;
+	}
+	for (uint64_t c = 0; c < z->chunks; c++) {
+		if (z->index[c + 1] < z->index[c]) goto fail;
+	}
+	z->slots_len = slots;
+	for (size_t i = 0; i < slots; i++) {
+		z->slots[i].chunk = NO_CHUNK;
+		z->slots[i].ready = true;
+	}
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+	return z;
+fail:
+	free(z->index);
+	free(z->slots);
+	free(z);
+	return NULL;
+}
+
+void
+exz_free(struct exz *z)
+{
+	fprintf(stderr, "inflate hit   %7lu\n", z->hit);
+	fprintf(stderr, "inflate miss  %7lu\n", z->miss);
+	for (size_t i = 0; i < z->slots_len; i++) {
+		free(z->slots[i].data);
+	}
+	pthread_cond_destroy(&z->cond);
+	pthread_mutex_destroy(&z->lock);
+	free(z->slots);
+	free(z->index);
+	free(z);
+}
+
+/* Returns the slot holding chunk c, inflating it if needed, with a reference
+ * taken. */
+static struct slot *
+get(struct exz *z, uint64_t c)
+{
+	struct slot *s;
+	pthread_mutex_lock(&z->lock);
+	for (;;) {
+		struct slot *victim = NULL;
+		s = NULL;
+		for (size_t i = 0; i < z->slots_len; i++) {
+			struct slot *t = &z->slots[i];
+			if (t->chunk == c) {
+				s = t;
+				break;
+			}
+			if (t->refs == 0 && t->ready && (!victim || t->lastuse < victim->lastuse)) {
+				victim = t;
+			}
+		}
+		if (s && s->ready) {
+			s->refs++;
+			s->lastuse = ++z->clock;
+			z->hit++;
+			pthread_mutex_unlock(&z->lock);
+			return s;
+		} else if (!s && victim) {
+			s = victim;
+			break;
+		}
+		/* someone else is inflating it, or every slot is in use */
+		pthread_cond_wait(&z->cond, &z->lock);
+	}
+	s->chunk = c;
+	s->ready = false;
+	s->refs = 1;
+	s->lastuse = ++z->clock;
+	z->miss++;
+	pthread_mutex_unlock(&z->lock);
+
+	if (!s->data) {
+		s->data = malloc(z->chunk);
+	}
+	if (!s->data || inflate_chunk(z, c, s->data) < 0) {
+		pthread_mutex_lock(&z->lock);
+		s->chunk = NO_CHUNK;
+		s->ready = true;
+		s->refs = 0;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+		return NULL;
+	}
+	pthread_mutex_lock(&z->lock);
+	s->ready = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+	return s;
+}
+
+static void
+put(struct exz *z, struct slot *s)
+{
+	pthread_mutex_lock(&z->lock);
+	if (--s->refs == 0) {
+		pthread_cond_broadcast(&z->cond);
+	}
+	pthread_mutex_unlock(&z->lock);
+}
+
+int
+exz_read(void *userdata, void *buf, size_t len, size_t off)
+{
+	struct exz *z = userdata;
+	char *p = buf;
+	if (off + len > z->size) {
+		return -1;
+	}
+	while (len > 0) {
+		uint64_t c = off / z->chunk;
+		size_t in = off % z->chunk;
+		size_t n = z->chunk - in < len ? z->chunk - in : len;
+		struct slot *s = get(z, c);
+		if (!s) return -1;
+		memcpy(p, s->data + in, n);
+		put(z, s);
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+exz_write(void *userdata, const void *buf, size_t len, size_t off)
+{
+	(void)userdata; (void)buf; (void)len; (void)off;
+	return -1;
+}
+
+uint64_t
+exz_size(struct exz *z)
+{
+	return z->size;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "ex_cache.h"
+#include <stdint.h>
+
+/* Compressed images, which can be used without unpacking them first.
+ * The image gets split into fixed-size chunks, each compressed with zlib on
+ * its own. An index of where every chunk starts comes right after the header,
+ * so opening an image only reads those, and every read only inflates the
+ * chunks it touches. The most recently used chunks are kept inflated.
+ *
+ * File layout, in host byte order:
+ *   0   magic, chunk size (uint32_t), image size (uint64_t)
+ *   16  index, chunks + 1 uint64_t file offsets, chunk i spans [index[i], index[i + 1])
+ *       A chunk is all zeroes if it's empty, and stored as-is if it's
+ *       as long as the image chunk (because it didn't compress). */
+#define EXZ_MAGIC "E2Z1"
+
+struct exz;
+
+/** Converts the raw image in_fd. chunk must be a power of 2. 0 on success. */
+int exz_pack(int in_fd, int out_fd, uint32_t chunk, int level);
+/** Keeps up to slots inflated chunks around. NULL if fd isn't a compressed
+ * image. */
+struct exz *exz_open(int fd, size_t slots);
+void exz_free(struct exz *z);
+/** For one of the caches, with the exz as the userdata. Thread-safe. */
+int exz_read(void *userdata, void *buf, size_t len, size_t off);
+/** Compressed images are read-only, this always fails. */
+int exz_write(void *userdata, const void *buf, size_t len, size_t off);
+uint64_t exz_size(struct exz *z);
@@ -1,10 +1,13 @@
 #include "ex_cache.h"
+#include "ex_overlay.h"
+#include "ex_record.h"
 #include "ext2.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define errx(ret, ...) do { \
@@ -15,6 +18,7 @@
 
 static int my_read(void *userdata, void *buf, size_t len, size_t off);
 static int my_write(void *userdata, const void *buf, size_t len, size_t off);
+static uint32_t my_gettime32(struct e2device *dev);
 static void tree(struct ext2 *fs, uint32_t inode_n, const char *name, bool header);
 static uint32_t splitdir(struct ext2 *fs, const char *path, char **name);
 
@@ -38,21 +42,60 @@ my_write(void *userdata, const void *buf, size_t len, size_t off)
 	}
 }
 
+static uint32_t
+my_gettime32(struct e2device *dev)
+{
+	(void)dev;
+	return time(NULL);
+}
+
 int
 main(int argc, char **argv)
 {
 	if (argc < 2) errx(1, "no arguments");
 
-	int fd = open(argv[1], O_RDWR);
+	/* With EX_OVERLAY set, the image is only read, and all changes go to that
+	 * delta instead (see e2overlay). */
+	const char *overlay = getenv("EX_OVERLAY");
+	int fd = open(argv[1], overlay ? O_RDONLY : O_RDWR);
 	if (fd < 0) errx(1, "couldn't open %s", argv[1]);
+	int delta = -1;
+	struct exo *exo = NULL;
+	if (overlay) {
+		delta = open(overlay, O_RDWR);
+		if (delta < 0) errx(1, "couldn't open %s", overlay);
+		exo = exo_open(fd, delta);
+		if (!exo) errx(1, "%s isn't a delta of %s", overlay, argv[1]);
+	}
 
 	/* Not part of the main library - just initializing the example caching impl from
 	 * ex_cache. */
-	struct e2device *dev = exc_init(my_read, my_write, (void*)(intptr_t)fd);
+	struct e2device *dev;
+	if (exo) {
+		dev = exc_init(exo_read, exo_write, exo);
+	} else {
+		dev = exc_init(my_read, my_write, (void*)(intptr_t)fd);
+	}
 	if (!dev) errx(1, "exc_init failed");
 
-	struct ext2 *fs = ext2_opendev(dev, exc_req, exc_drop);
+	/* With EX_RECORD set, every request gets logged to that file, for e2replay. */
+	const char *record = getenv("EX_RECORD");
+	FILE *recf = NULL;
+	struct e2device *rec = NULL;
+	struct ext2 *fs;
+	if (record) {
+		recf = fopen(record, "wb");
+		if (!recf) errx(1, "couldn't open %s", record);
+		rec = exr_init(dev, exc_req, NULL, exc_drop, recf);
+		if (!rec) errx(1, "exr_init failed");
+		fs = ext2_opendev(rec, exr_req, exr_drop);
+	} else {
+		fs = ext2_opendev(dev, exc_req, exc_drop);
+	}
 	if (!fs) errx(1, "ext2_opendev failed");
+	/* Keep the timestamps up to date, but only write them back once a minute
+	 * (or when the inode leaves the cache). */
+	ext2_settime(fs, my_gettime32, 60);
 
 	/* IO is done using "requests" - to make caching easier, instead of using
 	 * a pread/pwrite-style interface, the library asks the caching impl for a
@@ -102,7 +145,7 @@ main(int argc, char **argv)
 			off += len;
 		}
 	} else if (strcmp(argv[2], "write") == 0) {
-		if (argc < 3) errx(1, "usage: ./example write path [count]");
+		if (argc < 3) errx(1, "usage: ./example write path [count|-]");
 		const char *path = argv[3];
 		int count = argv[4] ? atoi(argv[4]) : 0;
 
@@ -124,16 +167,8 @@ main(int argc, char **argv)
 			}
 		}
 
-		{
-			struct ext2d_inode *inode;
-			inode = ext2_req_inode(fs, n);
-			if (!inode) {
-				errx(1, "couldn't read inode %u", n);
-			}
-			inode->size_lower = 0;
-			if (ext2_dropreq(fs, inode, true) < 0) {
-				errx(1, "couldn't save inode %u", n);
-			}
+		if (ext2_truncate(fs, n, 0) < 0) {
+			errx(1, "couldn't truncate inode %u", n);
 		}
 
 		for (int i = 0; i < count; i++) {
@@ -142,6 +177,69 @@ main(int argc, char **argv)
 				errx(1, "write error");
 			}
 		}
+
+		/* With "-", stdin gets read straight into the file's blocks. Every
+		 * byte of a write request has to be filled in, so the file gets
+		 * truncated to the real length at the end. */
+		if (argv[4] && strcmp(argv[4], "-") == 0) {
+			size_t off = 0;
+			for (;;) {
+				size_t len = 0, got = 0;
+				char *p = ext2_req_file_write(fs, n, &len, off);
+				if (!p) errx(1, "write error");
+				while (got < len) {
+					ssize_t r = read(0, p + got, len - got);
+					if (r <= 0) break;
+					got += r;
+				}
+				memset(p + got, 0, len - got);
+				if (ext2_drop_file_write(fs, n, p, off, len) < 0) {
+					errx(1, "write error");
+				}
+				off += got;
+				if (got < len) break;
+			}
+			if (ext2_truncate(fs, n, off) < 0) {
+				errx(1, "couldn't truncate inode %u", n);
+			}
+		}
+	} else if (strcmp(argv[2], "copy") == 0) {
+		if (argc < 5) errx(1, "usage: ./example copy src target");
+		const char *src = argv[3];
+		const char *target = argv[4];
+		uint32_t src_n, n;
+		size_t flen;
+
+		src_n = ext2c_walk(fs, src, strlen(src));
+		if (!src_n) errx(1, "no such file");
+		{
+			struct ext2d_inode *inode = ext2_req_inode(fs, src_n);
+			if (!inode) errx(1, "couldn't read inode %u", src_n);
+			flen = inode->size_lower;
+			ext2_dropreq(fs, inode, false);
+		}
+
+		n = ext2c_walk(fs, target, strlen(target));
+		if (!n) {
+			char *name;
+			uint32_t dir_n = splitdir(fs, target, &name);
+			if (!dir_n) errx(1, "target directory doesn't exist");
+			n = ext2_alloc_inode(fs, 0100700);
+			if (n == 0) errx(1, "couldn't allocate inode");
+			if (ext2_link(fs, dir_n, name, n, 0) < 0) {
+				errx(1, "couldn't create link");
+			}
+		}
+		if (n == src_n) errx(1, "%s and %s are the same file", src, target);
+		if (ext2_truncate(fs, n, 0) < 0) {
+			errx(1, "couldn't truncate inode %u", n);
+		}
+		/* The data doesn't pass through here. ex_cache has no copy hook,
+		 * so the library copies it a block at a time through a bounce
+		 * buffer of its own. */
+		if (ext2_copy_range(fs, src_n, 0, n, 0, flen) != (int)flen) {
+			errx(1, "copy failed");
+		}
 	} else if (strcmp(argv[2], "link") == 0) {
 		if (argc < 4) errx(1, "usage: ./example link src target");
 		const char *src = argv[3];
@@ -173,6 +271,11 @@ main(int argc, char **argv)
 		if (ext2_unlink(fs, dir_n, name) == 0) {
 			errx(1, "deletion failed\n");
 		}
+		/* The blocks only get freed by ext2_reclaim. A long running program
+		 * would call it with a small budget whenever it's idle. */
+		if (ext2_reclaim(fs, ~0) < 0) {
+			errx(1, "reclaim failed\n");
+		}
 	} else if (strcmp(argv[2], "tree") == 0) {
 		const char *path = argv[3] ? argv[3] : "/";
 		uint32_t n = ext2c_walk(fs, path, strlen(path));
@@ -183,7 +286,16 @@ main(int argc, char **argv)
 	} else {
 		errx(1, "unknown command '%s'", argv[2]);
 	}
+	ext2_free(fs);
+	if (rec) {
+		exr_free(rec);
+		fclose(recf);
+	}
 	exc_free(dev);
+	if (exo) {
+		exo_free(exo);
+		close(delta);
+	}
 }
 
 static void
@@ -1,8 +1,24 @@
 #pragma once
 #include "ext2d.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 
+/* Threading:
+ * ext2_read, ext2_diriter, ext2c_walk, ext2_write, ext2_truncate, ext2_link,
+ * ext2_unlink, ext2_reclaim and the allocators can be called concurrently.
+ * Readers of the same inode run in parallel, writers are serialized per inode
+ * (and per block group while touching the bitmaps). The ext2_req_* functions
+ * don't lock anything, their callers are responsible for that.
+ * ext2_opendev, ext2_sync and ext2_free must not run concurrently with anything.
+ * The async operations (see async.c) count as their blocking counterparts.
+ *
+ * If the device is used from multiple threads, req and drop must be
+ * thread-safe, and must allow multiple requests to be active at once.
+ * Overlapping requests must share memory, as two threads can e.g. modify
+ * different inodes within a single inode table block. */
+
 struct e2device; /* provided by the user */
 typedef void *(*e2device_req)(struct e2device *dev, size_t len, size_t off);
 /* 0 on success, -1 on failure to write */
@@ -10,16 +26,148 @@ typedef int (*e2device_drop)(struct e2device *dev, void *ptr, bool dirty);
 /* mustn't return 0 */
 typedef uint32_t (*e2device_gettime32)(struct e2device *dev);
 
+/* What a request is for, the flags can be combined. */
+enum e2device_hint {
+	E2HintMeta = 1 << 0, /* filesystem structures, otherwise file data */
+	E2HintSeq = 1 << 1, /* the following area will most likely be requested next */
+	E2HintReuse = 1 << 2, /* likely to be requested again soon */
+};
+/* Optional variant of e2device_req, see ext2_setreqh. */
+typedef void *(*e2device_reqh)(struct e2device *dev, size_t len, size_t off, unsigned hint);
+struct ext2_aop;
+/* Optional non-blocking variant of e2device_reqh, see ext2_setreqa.
+ * If the area isn't available right away, it returns E2DEVICE_PENDING instead
+ * of waiting, and has ext2_aop_wake(op) called once it is. */
+typedef void *(*e2device_reqa)(struct e2device *dev, size_t len, size_t off, unsigned hint, struct ext2_aop *op);
+#define E2DEVICE_PENDING ((void*)-1)
+/* Optional, see ext2_setcopy. Copies len bytes from src_off to dst_off, which
+ * never overlap. Only called with whole blocks, unless the file offsets
+ * aren't block aligned. 0 on success, -1 on failure. */
+typedef int (*e2device_copy)(struct e2device *dev, size_t dst_off, size_t src_off, size_t len);
+
+/* Where in the library a device request comes from. */
+enum ext2_site {
+	Ext2SiteSb,
+	Ext2SiteBgdt,
+	Ext2SiteBitmap,
+	Ext2SiteInode, /* the inode table */
+	Ext2SiteBlockmap, /* block pointers, both in the inode and indirect */
+	Ext2SiteFile, /* file data */
+	Ext2SiteDirent,
+	Ext2SiteAlloc, /* zeroing newly allocated blocks */
+	Ext2SiteCount,
+};
+
+struct ext2_trace {
+	enum ext2_site site;
+	bool drop; /* otherwise it's a request */
+	bool dirty; /* only for drops */
+	uint32_t inode_n; /* 0 if there's no related inode */
+	size_t off, len;
+	void *ptr; /* NULL if the request failed */
+};
+/* Called after every request and before every drop, possibly from multiple
+ * threads at once. */
+typedef void (*ext2_tracefn)(void *userdata, const struct ext2_trace *t);
+/* Called by ext2_bulkstat for every used inode. Returning nonzero stops it. */
+typedef int (*ext2_bulkstatfn)(void *userdata, uint32_t inode_n, const struct ext2d_inode *inode);
+
+/* a request that hasn't been dropped yet, see trace.c */
+struct ext2i_trace_ent {
+	void *ptr;
+	enum ext2_site site;
+	uint32_t inode_n;
+	size_t off, len;
+};
+
+struct ext2i_icache_ent {
+	struct ext2d_inode inode; /* must be first */
+	uint32_t inode_n; /* 0 if unused */
+	uint32_t lastuse;
+	uint32_t pins; /* can't be evicted while > 0 */
+	bool dirty;
+	bool loading; /* being written back and refilled with next_n */
+	bool writing; /* being written back by ext2i_touch */
+	uint32_t next_n;
+	uint32_t lazy; /* when the timestamps were first changed without being written back, or 0 */
+};
+
+/* spare blocks reserved for a growing file, see resv.c */
+struct ext2i_resv {
+	uint32_t inode_n; /* 0 if unused */
+	uint32_t iblock; /* the file block start would be mapped at */
+	uint32_t start, len;
+	uint32_t win; /* size of the last window */
+	uint32_t lastuse;
+};
+
+/* x / d and x % d, by a shift and a mask if d is a power of 2 */
+struct ext2i_divisor {
+	uint32_t d;
+	int shift; /* -1 if d isn't a power of 2 */
+};
+
+#define EXT2_INODE_LOCKS 64
+#define EXT2_RESV_SLOTS 32
+
 struct ext2 {
 	struct e2device *dev;
 	e2device_req req;
 	e2device_drop drop;
 	e2device_gettime32 gettime32;
+	e2device_reqh reqh; /* used instead of req if set */
+	e2device_reqa reqa; /* used by async operations if set, see async.c */
+	e2device_copy copy; /* used by ext2_copy_range if set */
+	bool touch; /* maintain the timestamps, see ext2_settime */
+	uint32_t lazytime;
 
 	bool rw;
 	uint32_t groups;
+	/* A zeroed block, handed out for holes. ext2_dropreq recognizes it. */
+	char *zeroes;
 	uint64_t block_size, frag_size, inode_size;
 	uint64_t inodes_per_group, blocks_per_group;
+	uint32_t first_data_block;
+	/* precomputed by ext2_opendev, the block size is always a power of 2 */
+	unsigned block_shift;
+	uint64_t block_mask;
+	unsigned ptr_shift; /* log2 of the block pointers per block */
+	struct ext2i_divisor ipg, bpg; /* inodes and blocks per group */
+
+	/* see icache.c */
+	struct {
+		struct ext2i_icache_ent *ents;
+		size_t len; /* in the sets */
+		size_t total; /* and the spill entries after them */
+		uint32_t clock;
+		pthread_mutex_t lock;
+		pthread_cond_t cond; /* signalled when a pin gets dropped, or an entry's I/O is done */
+		unsigned waiting;
+	} icache;
+
+	/* see trace.c */
+	struct {
+		ext2_tracefn fn; /* NULL if disabled */
+		void *userdata;
+		struct ext2i_trace_ent *active;
+		size_t len, cap;
+		pthread_mutex_t lock;
+	} trace;
+
+	/* see resv.c */
+	struct {
+		struct ext2i_resv ents[EXT2_RESV_SLOTS];
+		uint32_t clock;
+		pthread_mutex_t lock;
+	} resv;
+
+	/* Lock order: inode, orphan, group, sb, icache, trace.
+	 * Two inode locks are taken in the order of their addresses.
+	 * resv.lock is never held while taking any other lock. */
+	pthread_rwlock_t inode_locks[EXT2_INODE_LOCKS]; /* striped */
+	pthread_mutex_t orphan_lock;
+	pthread_mutex_t *group_locks;
+	pthread_mutex_t sb_lock;
 };
 
 struct ext2_diriter {
@@ -33,49 +181,269 @@ struct ext2_diriter {
 	} _internal;
 };
 
+/* An asynchronous operation, allocated by the caller. It must stay alive
+ * until done gets called. */
+typedef void (*ext2_aopfn)(struct ext2_aop *op);
+struct ext2_aop {
+	ext2_aopfn done;
+	void *userdata; /* not used by the library */
+	size_t ret; /* the result, set before done gets called */
+
+	struct {
+		struct ext2 *fs;
+		int kind;
+		uint32_t inode_n;
+		void *buf;
+		const char *path;
+		size_t len, off, pos;
+		struct ext2_diriter iter;
+		bool pending; /* the current attempt is waiting for the device */
+		bool parked, woken, failed;
+		pthread_mutex_t lock; /* protects parked, woken and failed */
+	} _internal;
+};
+
 enum ext2_bitmap {
 	Ext2Inode,
 	Ext2Block,
 };
 
 struct ext2 *ext2_opendev(struct e2device *dev, e2device_req req_fn, e2device_drop drop_fn);
+/** Writes back all the dirty cached inodes, and frees the blocks reserved
+ * for growing files. */
+int ext2_sync(struct ext2 *fs);
+/** Syncs and frees the fs. Must be called before the device gets freed. */
 void ext2_free(struct ext2 *fs);
+/** Makes the library request through fn, with a hint of what the request is
+ * for. NULL goes back to the plain req function. */
+void ext2_setreqh(struct ext2 *fs, e2device_reqh fn);
+/** Makes the fs read-only, as if it had unsupported features: everything that
+ * would change it fails, and no timestamps get updated. */
+void ext2_setro(struct ext2 *fs);
+/** Makes reads, writes, truncation and linking update the timestamps of the
+ * inodes involved, with fn as the clock. NULL turns that off again.
+ * With lazy > 0, changes that only touch the timestamps are kept in the inode
+ * cache, and written back by ext2_sync, on eviction, or once they're lazy
+ * seconds old. With lazy == 0, they're written back right away.
+ * Failing to write a timestamp doesn't fail the operation. */
+void ext2_settime(struct ext2 *fs, e2device_gettime32 fn, uint32_t lazy);
+/** Makes the async operations request through fn, so they get suspended
+ * instead of waiting for the device. Without it, they run synchronously.
+ * The plain req (or reqh) function is still used by everything else. */
+void ext2_setreqa(struct ext2 *fs, e2device_reqa fn);
+/** Makes ext2_copy_range copy through fn, instead of requesting every block
+ * of both files. It isn't used while tracing. NULL turns it off again. */
+void ext2_setcopy(struct ext2 *fs, e2device_copy fn);
+/** Calls fn for every device request and drop, or stops tracing if fn is NULL.
+ * There mustn't be any active requests while calling this. */
+void ext2_settrace(struct ext2 *fs, ext2_tracefn fn, void *userdata);
 
-static inline int ext2_dropreq(struct ext2 *fs, void *ptr, bool dirty) {
+static inline struct ext2i_icache_ent *ext2i_icache_ent(struct ext2 *fs, void *ptr) {
+	uintptr_t base = (uintptr_t)fs->icache.ents;
+	if (!(base <= (uintptr_t)ptr && (uintptr_t)ptr < base + fs->icache.total * sizeof *fs->icache.ents))
+		return NULL;
+	return &fs->icache.ents[((uintptr_t)ptr - base) / sizeof *fs->icache.ents];
+}
+int ext2i_icache_drop(struct ext2 *fs, void *ptr, bool dirty);
+
+void ext2i_trace_req(struct ext2 *fs, enum ext2_site site, uint32_t inode_n, void *ptr, size_t len, size_t off);
+void ext2i_trace_drop(struct ext2 *fs, void *ptr, bool dirty);
+/* All the device requests made by the library go through those.
+ * The hint is derived from the site, callers only add E2HintSeq. */
+static inline unsigned ext2i_site_hint(enum ext2_site site) {
+	if (site == Ext2SiteFile) return 0;
+	if (site == Ext2SiteAlloc) return E2HintReuse; /* about to be filled in */
+	return E2HintMeta | E2HintReuse;
+}
+struct ext2_aop *ext2i_aop_current(void);
+void *ext2i_reqa(struct ext2 *fs, struct ext2_aop *op, size_t len, size_t off, unsigned hint);
+static inline void *ext2i_reqh(struct ext2 *fs, enum ext2_site site, unsigned hint, uint32_t inode_n, size_t len, size_t off) {
+	void *p;
+	struct ext2_aop *op;
+	if (fs->reqa && (op = ext2i_aop_current()))
+		p = ext2i_reqa(fs, op, len, off, ext2i_site_hint(site) | hint);
+	else if (fs->reqh)
+		p = fs->reqh(fs->dev, len, off, ext2i_site_hint(site) | hint);
+	else
+		p = fs->req(fs->dev, len, off);
+	if (fs->trace.fn)
+		ext2i_trace_req(fs, site, inode_n, p, len, off);
+	return p;
+}
+static inline void *ext2i_req(struct ext2 *fs, enum ext2_site site, uint32_t inode_n, size_t len, size_t off) {
+	return ext2i_reqh(fs, site, 0, inode_n, len, off);
+}
+static inline int ext2i_drop(struct ext2 *fs, void *ptr, bool dirty) {
+	if (fs->trace.fn)
+		ext2i_trace_drop(fs, ptr, dirty);
 	return fs->drop(fs->dev, ptr, dirty);
 }
+
+static inline bool ext2i_is_zeroes(struct ext2 *fs, void *ptr) {
+	return fs->zeroes <= (char*)ptr && (char*)ptr < fs->zeroes + fs->block_size;
+}
+
+static inline int ext2_dropreq(struct ext2 *fs, void *ptr, bool dirty) {
+	if (ext2i_icache_ent(fs, ptr))
+		return ext2i_icache_drop(fs, ptr, dirty);
+	if (ext2i_is_zeroes(fs, ptr))
+		return dirty ? -1 : 0; /* holes can't be written through a request */
+	return ext2i_drop(fs, ptr, dirty);
+}
 struct ext2d_inode *ext2_req_inode(struct ext2 *fs, uint32_t inode_n);
+/** Holes are returned as zeroes, and mustn't be dropped as dirty. */
 void *ext2_req_file(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off);
 struct ext2d_bgd *ext2_req_bgdt(struct ext2 *fs, uint32_t idx);
 struct ext2d_superblock *ext2_req_sb(struct ext2 *fs);
 void *ext2_req_bitmap(struct ext2 *fs, uint32_t group, enum ext2_bitmap type);
+/** Without alloc, the parts of the map that would be in missing indirect
+ * blocks are returned as zeroes. */
 uint32_t *ext2_req_blockmap(struct ext2 *fs, uint32_t inode_n, size_t *len, uint32_t off, bool alloc);
 
 int ext2_read(struct ext2 *fs, uint32_t inode_n, void *buf, size_t len, size_t off);
 bool ext2_diriter(struct ext2_diriter *iter, struct ext2 *fs, uint32_t inode_n);
+/** Calls fn for every used inode among the count inodes of the group starting
+ * at index start, reading the inode table a block at a time and skipping the
+ * blocks without used inodes. Inodes in the inode cache are reported as
+ * cached. fn can use the fs, no requests are active while it runs.
+ * Inodes that change concurrently may be reported in either state. The
+ * cached ones are copied under their inode lock, so the caller mustn't hold
+ * any inode lock. An inode that isn't cached is copied from the inode table
+ * without it, and may be torn if the inode cache writes it back meanwhile.
+ * @return the number of inodes reported, -1 on failure */
+int ext2_bulkstat(struct ext2 *fs, uint32_t group, uint32_t start, uint32_t count,
+		ext2_bulkstatfn fn, void *userdata);
 
 /** Returns the on-disk address and available length of the inode at pos.
- * On success, *dev_len > 0. */
-// TODO consider a mirror interface to ext2_req
+ * @return 0 on success, 1 if pos is in a hole (then *dev_len is the length
+ * of the hole, as far as it's known), -1 on failure. *dev_len is always > 0
+ * unless it failed. */
 int ext2_inode_ondisk(struct ext2 *fs, uint32_t inode_n, size_t pos, size_t *dev_off, size_t *dev_len);
 
 uint32_t ext2c_walk(struct ext2 *fs, const char *path, size_t plen);
 
+/* Async variants of the above, see async.c. They complete through op->done,
+ * either before returning or from a thread calling ext2_aop_wake. */
+/** op->ret is what ext2_read would return. */
+void ext2_read_async(struct ext2 *fs, struct ext2_aop *op, uint32_t inode_n, void *buf, size_t len, size_t off);
+/** op->ret is the inode, 0 if it wasn't found. path must stay alive too. */
+void ext2c_walk_async(struct ext2 *fs, struct ext2_aop *op, const char *path, size_t plen);
+/** Called for the device once the area an op was pending on can be requested
+ * without waiting, or with failed set if it couldn't be read, which fails the
+ * op. Continues the op on the calling thread, which mustn't be inside a
+ * request of another op. */
+void ext2_aop_wake(struct ext2_aop *op, bool failed);
+
 int ext2_write(struct ext2 *fs, uint32_t inode_n, const void *buf, size_t len, size_t off);
+/** The writing counterpart of ext2_req_file, for filling the file in place.
+ * Allocates the area if needed, and returns a pointer to up to *len bytes at
+ * off (to the end of the block if *len is 0), never crossing a block boundary.
+ * All of the returned *len bytes must be filled in, newly allocated blocks
+ * aren't zeroed. To end the file within the area, fill it anyway and
+ * ext2_truncate afterwards.
+ * Like the other ext2_req_* functions, this doesn't lock the inode. */
+void *ext2_req_file_write(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off);
+/** Drops a pointer returned by ext2_req_file_write, with the same off and
+ * *len, extending the file to off + len if it's shorter. */
+int ext2_drop_file_write(struct ext2 *fs, uint32_t inode_n, void *ptr, size_t off, size_t len);
+/** Copies len bytes of src_n at src_off to dst_n at dst_off, like ext2_write
+ * would, but without passing them through a buffer of the caller's. Stops at
+ * the end of the source, and after INT_MAX bytes. Holes in the source read as
+ * zeroes in the destination, and only get allocated where the destination
+ * already had blocks. The ranges mustn't overlap if both inodes are the same.
+ * If it fails, the destination's size is unchanged, and the part within it
+ * may be partially copied.
+ * @return the amount copied, -1 on failure */
+int ext2_copy_range(struct ext2 *fs, uint32_t src_n, size_t src_off, uint32_t dst_n, size_t dst_off, size_t len);
 int ext2_link(struct ext2 *fs, uint32_t dir_n, const char *name, uint32_t target_n, int flags);
-/** @return the corresponding inode, 0 on failure */
+/** @return the corresponding inode, 0 on failure
+ * If that was the last link, the inode gets put on the orphan list instead of
+ * being freed - see ext2_reclaim. */
 uint32_t ext2_unlink(struct ext2 *fs, uint32_t dir_n, const char *name);
+/** Frees up to about budget blocks of orphaned inodes.
+ * @return 1 if there are orphans left, 0 if there aren't, -1 on failure */
+int ext2_reclaim(struct ext2 *fs, uint32_t budget);
 /** @return the allocated inode, 0 on failure */
 // TODO should probably take a group preference argument
 uint32_t ext2_alloc_inode(struct ext2 *fs, uint16_t perms);
-// TODO and this should be able to allocate runs of blocks
 uint32_t ext2_alloc_block(struct ext2 *fs);
+/** Allocates up to want consecutive blocks, preferably starting at goal.
+ * @return the first block, 0 on failure. *got is set to the amount allocated. */
+uint32_t ext2_alloc_blocks(struct ext2 *fs, uint32_t goal, uint32_t want, uint32_t *got);
 
+/** Allocates contiguous blocks for the bytes [off, off + len) of the inode,
+ * as far as free space allows, and extends the file to off + len if it's
+ * shorter. Newly allocated areas read as zeroes. */
+int ext2_fallocate(struct ext2 *fs, uint32_t inode_n, size_t off, size_t len);
+/** Allocates every block of the first len bytes. Doesn't lock the inode. */
 int ext2_alloc_space(struct ext2 *fs, uint32_t inode_n, size_t len);
+/** Sets the size of the file, freeing (or allocating) blocks as needed. */
+int ext2_truncate(struct ext2 *fs, uint32_t inode_n, size_t new_size);
 
 
 /* misc internal functions
  * the other interfaces aren't stable yet, but those will never be. please avoid them. */
 /* should possibly be moved into a separate header file */
+static inline pthread_rwlock_t *ext2i_inode_lock(struct ext2 *fs, uint32_t inode_n) {
+	return &fs->inode_locks[inode_n % EXT2_INODE_LOCKS];
+}
+static inline uint32_t ext2i_div(struct ext2i_divisor dv, uint32_t x) {
+	return dv.shift >= 0 ? x >> dv.shift : x / dv.d;
+}
+static inline uint32_t ext2i_mod(struct ext2i_divisor dv, uint32_t x) {
+	return dv.shift >= 0 ? x & (dv.d - 1) : x % dv.d;
+}
+/** ext2_req_file for callers other than file data, e.g. directories */
+void *ext2i_req_file(struct ext2 *fs, enum ext2_site site, unsigned hint, uint32_t inode_n, size_t *len, size_t off);
+/** ext2_truncate without the locking */
+int ext2i_truncate(struct ext2 *fs, uint32_t inode_n, size_t new_size);
 int ext2i_change_linkcnt(struct ext2 *fs, uint32_t inode_n, int d);
 int ext2i_bitmap_alloc(uint8_t *bitmap, size_t buflen, size_t bitlen, uint32_t *target);
+/** Marks up to want free bits, starting with the first free one at or after
+ * start. @return the amount marked, the first one is stored in *target */
+uint32_t ext2i_bitmap_alloc_run(uint8_t *bitmap, size_t buflen, size_t bitlen,
+		uint32_t start, uint32_t want, uint32_t *target);
+/* flags for ext2i_alloc_range */
+enum {
+	/* take the last run from (and refill) the inode's reservation window */
+	Ext2AllocAppend = 1 << 0,
+	/* the caller is about to write the whole range, so only the blocks it
+	 * covers partially need zeroing */
+	Ext2AllocFill = 1 << 1,
+};
+/** Allocates the blocks backing the bytes [off, end) of the inode. */
+int ext2i_alloc_range(struct ext2 *fs, uint32_t inode_n, size_t off, size_t end, unsigned flags);
+/** ext2_alloc_blocks without zeroing the blocks. */
+uint32_t ext2i_alloc_blocks(struct ext2 *fs, uint32_t goal, uint32_t want, uint32_t *got);
+/** Marks len blocks starting at block as free. */
+int ext2i_free_blocks(struct ext2 *fs, uint32_t block, uint32_t len);
+/** Takes up to want blocks from the inode's window if it continues at iblock.
+ * @return the first block, 0 if there's nothing to take */
+uint32_t ext2i_resv_take(struct ext2 *fs, uint32_t inode_n, uint32_t iblock, uint32_t want, uint32_t *got);
+/** How many spare blocks to reserve next time the inode's window runs out. */
+uint32_t ext2i_resv_window(struct ext2 *fs, uint32_t inode_n);
+/** Replaces the inode's window with [block, block + len), to be mapped at
+ * iblock. Whatever was left in the old one gets freed. */
+int ext2i_resv_put(struct ext2 *fs, uint32_t inode_n, uint32_t iblock, uint32_t block, uint32_t len, uint32_t win);
+/** Frees the unused part of the inode's window. */
+int ext2i_resv_release(struct ext2 *fs, uint32_t inode_n);
+int ext2i_resv_release_all(struct ext2 *fs);
+int ext2i_inodepos(struct ext2 *fs, uint32_t inode_n, uint64_t *pos);
+int ext2i_icache_init(struct ext2 *fs, size_t len);
+/** Returns a pinned cached inode, NULL on failure. */
+struct ext2d_inode *ext2i_icache_get(struct ext2 *fs, uint32_t inode_n);
+/** Copies the inode out if it's cached, without loading it otherwise. The
+ * caller holds the inode lock, at least for reading. */
+bool ext2i_icache_peek(struct ext2 *fs, uint32_t inode_n, struct ext2d_inode *out);
+/** Writes back a single inode if it's cached and dirty. */
+int ext2i_sync_inode(struct ext2 *fs, uint32_t inode_n);
+enum {
+	Ext2TouchA = 1 << 0,
+	Ext2TouchM = 1 << 1,
+	Ext2TouchC = 1 << 2,
+};
+/** Sets the given timestamps to the current time, if enabled. Best effort:
+ * it comes after the operation itself succeeded, which mustn't be reported
+ * as failed just because its timestamps couldn't be written. */
+void ext2i_touch(struct ext2 *fs, uint32_t inode_n, unsigned which);
+uint32_t ext2i_default_gettime32(struct e2device *dev);
@@ -54,6 +54,17 @@ struct ext2d_superblock {
 	char blkid[16];
 	char volname[16];
 	char lastmount[64];
+
+	uint32_t algo_bitmap;
+	uint8_t prealloc_blocks;
+	uint8_t prealloc_dir_blocks;
+	uint16_t reserved_gdt_blocks;
+
+	/* ext3 journaling, only last_orphan is used */
+	char journal_uuid[16];
+	uint32_t journal_inode;
+	uint32_t journal_dev;
+	uint32_t last_orphan; /* first inode of the orphan list, chained through dtime */
 } __attribute__((__packed__));
 
 struct ext2d_bgd {
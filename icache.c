@@ -0,0 +1,331 @@
+/* In-memory cache of inodes.
+ * ext2_req_inode hands out pointers into it, ext2_dropreq recognizes them and
+ * only marks the entry as dirty. Dirty inodes get written back on eviction
+ * and by ext2_sync.
+ * Timestamp updates (see ext2_settime) are tracked separately, as they're
+ * written back lazily: also on eviction and by ext2_sync, but otherwise only
+ * once the oldest unwritten update is fs->lazytime seconds old.
+ * The table is protected by icache.lock, the inodes themselves by the inode
+ * locks of their users. Readers share an inode lock, so the timestamps are
+ * only changed under icache.lock.
+ *
+ * Pinned entries can't be evicted, so a caller holding a few inodes that
+ * happen to share a set would find every way pinned. The spill entries after
+ * the sets take any inode then, and are searched along with every set. Once
+ * those are pinned too, ext2i_icache_get waits for a pin to be dropped. The
+ * library never holds more than a couple of inodes at once, so that only
+ * happens with many threads, which drop theirs soon.
+ *
+ * icache.lock isn't held during device I/O. An entry that gets evicted and
+ * refilled is marked as loading meanwhile, and one that ext2i_touch writes back
+ * as writing. Whoever needs either inode of a loading entry, or has to write
+ * back a busy one, waits on icache.cond. Everyone else carries on. */
+
+#include "ext2.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WAYS 4
+#define SPILL 16 /* entries */
+
+static int write_inode(struct ext2 *fs, uint32_t inode_n, const struct ext2d_inode *inode);
+static int writeback(struct ext2 *fs, struct ext2i_icache_ent *ent);
+static void wait_entry(struct ext2 *fs);
+static void wake_waiters(struct ext2 *fs);
+static struct ext2i_icache_ent *find(struct ext2 *fs, uint32_t inode_n);
+static struct ext2i_icache_ent *pick_victim(struct ext2 *fs, uint32_t inode_n);
+
+static int
+write_inode(struct ext2 *fs, uint32_t inode_n, const struct ext2d_inode *inode)
+{
+	uint64_t pos;
+	void *p;
+	if (ext2i_inodepos(fs, inode_n, &pos) < 0) {
+		return -1;
+	}
+	p = ext2i_req(fs, Ext2SiteInode, inode_n, sizeof *inode, pos);
+	if (!p) return -1;
+	memcpy(p, inode, sizeof *inode);
+	return ext2i_drop(fs, p, true);
+}
+
+/* Either with icache.lock held, or on a loading entry. */
+static int
+writeback(struct ext2 *fs, struct ext2i_icache_ent *ent)
+{
+	if (!ent->dirty && ent->lazy == 0) return 0;
+	if (write_inode(fs, ent->inode_n, &ent->inode) < 0) {
+		return -1;
+	}
+	ent->dirty = false;
+	ent->lazy = 0;
+	return 0;
+}
+
+/* With icache.lock held, as are the next ones. */
+static void
+wait_entry(struct ext2 *fs)
+{
+	fs->icache.waiting++;
+	pthread_cond_wait(&fs->icache.cond, &fs->icache.lock);
+	fs->icache.waiting--;
+}
+
+static void
+wake_waiters(struct ext2 *fs)
+{
+	if (fs->icache.waiting > 0) {
+		pthread_cond_broadcast(&fs->icache.cond);
+	}
+}
+
+/* The entry holding the inode, or being loaded with it. */
+static struct ext2i_icache_ent *
+find(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_icache_ent *set = &fs->icache.ents[inode_n % (fs->icache.len / WAYS) * WAYS];
+	for (int i = 0; i < WAYS; i++) {
+		if (set[i].inode_n == inode_n || set[i].next_n == inode_n) return &set[i];
+	}
+	for (size_t i = fs->icache.len; i < fs->icache.total; i++) {
+		struct ext2i_icache_ent *ent = &fs->icache.ents[i];
+		if (ent->inode_n == inode_n || ent->next_n == inode_n) return ent;
+	}
+	return NULL;
+}
+
+/* The least recently used unpinned entry of the inode's set, or of the spill
+ * entries if the whole set is pinned. */
+static struct ext2i_icache_ent *
+pick_victim(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_icache_ent *set = &fs->icache.ents[inode_n % (fs->icache.len / WAYS) * WAYS];
+	struct ext2i_icache_ent *spill = &fs->icache.ents[fs->icache.len];
+	struct ext2i_icache_ent *best = NULL;
+	for (size_t i = 0; i < WAYS + SPILL && !(best && i == WAYS); i++) {
+		struct ext2i_icache_ent *ent = i < WAYS ? &set[i] : &spill[i - WAYS];
+		if (ent->pins > 0 || ent->loading) continue;
+		if (!best || ent->inode_n == 0 ||
+			(best->inode_n != 0 && ent->lastuse < best->lastuse))
+		{
+			best = ent;
+		}
+	}
+	return best;
+}
+
+int
+ext2i_icache_init(struct ext2 *fs, size_t len)
+{
+	fs->icache.len = len - len % WAYS;
+	if (fs->icache.len == 0) return 0;
+	fs->icache.total = fs->icache.len + SPILL;
+	fs->icache.ents = calloc(fs->icache.total, sizeof *fs->icache.ents);
+	if (!fs->icache.ents) {
+		fs->icache.len = fs->icache.total = 0;
+		return -1;
+	}
+	return 0;
+}
+
+struct ext2d_inode *
+ext2i_icache_get(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_icache_ent *victim, *ret = NULL;
+	struct ext2d_inode inode;
+	bool ok;
+	uint64_t pos;
+	void *p;
+	if (fs->icache.len == 0) return NULL;
+
+	pthread_mutex_lock(&fs->icache.lock);
+	for (;;) {
+		ret = find(fs, inode_n);
+		if (ret && !ret->loading) goto out;
+		if (!ret) {
+			victim = pick_victim(fs, inode_n);
+			if (victim) break;
+		}
+		/* it's being loaded, or everything it could go in is pinned */
+		wait_entry(fs);
+	}
+
+	/* Nobody else touches a loading entry, so the old inode can be written
+	 * back from it without the lock. The new one is only copied in once
+	 * it's complete, for ext2i_icache_peek. */
+	victim->loading = true;
+	victim->next_n = inode_n;
+	pthread_mutex_unlock(&fs->icache.lock);
+	ok = victim->inode_n == 0 || writeback(fs, victim) == 0;
+	if (ok) {
+		ok = ext2i_inodepos(fs, inode_n, &pos) == 0
+			&& (p = ext2i_req(fs, Ext2SiteInode, inode_n, sizeof inode, pos));
+	}
+	if (ok) {
+		memcpy(&inode, p, sizeof inode);
+		ext2i_drop(fs, p, false);
+	}
+	pthread_mutex_lock(&fs->icache.lock);
+	victim->loading = false;
+	victim->next_n = 0;
+	/* on failure, the entry still holds the old inode */
+	if (ok) {
+		victim->inode = inode;
+		victim->inode_n = inode_n;
+		victim->dirty = false;
+		victim->lazy = 0;
+		ret = victim;
+	}
+	wake_waiters(fs);
+out:
+	if (ret) {
+		ret->pins++;
+		ret->lastuse = ++fs->icache.clock;
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	return ret ? &ret->inode : NULL;
+}
+
+bool
+ext2i_icache_peek(struct ext2 *fs, uint32_t inode_n, struct ext2d_inode *out)
+{
+	struct ext2i_icache_ent *ent;
+	if (fs->icache.len == 0) return false;
+	pthread_mutex_lock(&fs->icache.lock);
+	ent = find(fs, inode_n);
+	/* a loading entry still holds the inode it's evicting */
+	if (ent && ent->inode_n != inode_n) {
+		ent = NULL;
+	}
+	if (ent) {
+		memcpy(out, &ent->inode, sizeof *out);
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	return ent != NULL;
+}
+
+int
+ext2i_icache_drop(struct ext2 *fs, void *ptr, bool dirty)
+{
+	struct ext2i_icache_ent *ent = ext2i_icache_ent(fs, ptr);
+	pthread_mutex_lock(&fs->icache.lock);
+	ent->pins--;
+	ent->dirty |= dirty;
+	if (ent->pins == 0) {
+		wake_waiters(fs);
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	return 0;
+}
+
+void
+ext2i_touch(struct ext2 *fs, uint32_t inode_n, unsigned which)
+{
+	struct ext2d_inode *inode;
+	struct ext2i_icache_ent *ent;
+	struct ext2d_inode copy;
+	uint32_t now, lazy;
+	bool changed = false, write = false, dirty, ok;
+	if (!fs->touch || !fs->rw) return;
+	now = fs->gettime32(fs->dev);
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return;
+	ent = ext2i_icache_ent(fs, inode);
+	if (ent) pthread_mutex_lock(&fs->icache.lock);
+	if ((which & Ext2TouchA) && inode->atime != now) {
+		inode->atime = now;
+		changed = true;
+	}
+	if ((which & Ext2TouchM) && inode->mtime != now) {
+		inode->mtime = now;
+		changed = true;
+	}
+	if ((which & Ext2TouchC) && inode->ctime != now) {
+		inode->ctime = now;
+		changed = true;
+	}
+	if (!ent) {
+		/* nowhere to keep it, straight to the device */
+		ext2_dropreq(fs, inode, changed);
+		return;
+	}
+
+	if (changed && fs->lazytime == 0) {
+		ent->dirty = true;
+		write = true;
+	} else if (changed && ent->lazy == 0) {
+		ent->lazy = now;
+	} else if (changed && now - ent->lazy >= fs->lazytime) {
+		write = true;
+	}
+
+	/* A copy gets written back without the lock. A failed writeback leaves
+	 * the update pending, so the next one (or eviction, or ext2_sync) tries
+	 * again, as does one that finds another touch still writing. */
+	if (write && !ent->writing) {
+		copy = ent->inode;
+		dirty = ent->dirty;
+		lazy = ent->lazy;
+		ent->dirty = false;
+		ent->lazy = 0;
+		ent->writing = true;
+		pthread_mutex_unlock(&fs->icache.lock);
+		ok = write_inode(fs, inode_n, &copy) == 0;
+		pthread_mutex_lock(&fs->icache.lock);
+		ent->writing = false;
+		if (!ok) {
+			ent->dirty |= dirty;
+			if (ent->lazy == 0) ent->lazy = lazy;
+		}
+		wake_waiters(fs);
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	ext2_dropreq(fs, inode, false);
+}
+
+void
+ext2_settime(struct ext2 *fs, e2device_gettime32 fn, uint32_t lazy)
+{
+	fs->touch = fn != NULL;
+	fs->gettime32 = fn ? fn : ext2i_default_gettime32;
+	fs->lazytime = lazy;
+}
+
+int
+ext2i_sync_inode(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_icache_ent *ent;
+	int ret = 0;
+	if (fs->icache.len == 0) return 0;
+	pthread_mutex_lock(&fs->icache.lock);
+	while ((ent = find(fs, inode_n)) && (ent->loading || ent->writing)) {
+		wait_entry(fs);
+	}
+	if (ent) {
+		ret = writeback(fs, ent);
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	return ret;
+}
+
+int
+ext2_sync(struct ext2 *fs)
+{
+	int ret = 0;
+	if (ext2i_resv_release_all(fs) < 0) {
+		ret = -1;
+	}
+	pthread_mutex_lock(&fs->icache.lock);
+	for (size_t i = 0; i < fs->icache.total; i++) {
+		struct ext2i_icache_ent *ent = &fs->icache.ents[i];
+		while (ent->loading || ent->writing) {
+			wait_entry(fs);
+		}
+		if (ent->inode_n != 0 && writeback(fs, ent) < 0) {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&fs->icache.lock);
+	return ret;
+}
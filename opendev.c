@@ -3,7 +3,20 @@
 #include <stdlib.h>
 #include <string.h>
 
-static uint32_t ext2_default_gettime32(struct e2device *dev);
+#define ICACHE_SIZE 256 /* inodes */
+
+static struct ext2i_divisor divisor(uint32_t d);
+
+static struct ext2i_divisor
+divisor(uint32_t d)
+{
+	struct ext2i_divisor dv = {d, -1};
+	if (d != 0 && (d & (d - 1)) == 0) {
+		dv.shift = 0;
+		while ((d >> dv.shift) != 1) dv.shift++;
+	}
+	return dv;
+}
 
 struct ext2 *
 ext2_opendev(struct e2device *dev, e2device_req req_fn, e2device_drop drop_fn)
@@ -18,7 +31,7 @@ ext2_opendev(struct e2device *dev, e2device_req req_fn, e2device_drop drop_fn)
 	fs->dev = dev;
 	fs->req = req_fn;
 	fs->drop = drop_fn;
-	fs->gettime32 = ext2_default_gettime32;
+	fs->gettime32 = ext2i_default_gettime32;
 
 	sb = ext2_req_sb(fs);
 	if (!sb)
@@ -40,20 +53,54 @@ ext2_opendev(struct e2device *dev, e2device_req req_fn, e2device_drop drop_fn)
 
 	if (sb->block_size_log > 63 - 10) goto err;
 	fs->block_size = 1024 << sb->block_size_log;
+	fs->block_shift = 10 + sb->block_size_log;
+	fs->block_mask = fs->block_size - 1;
+	fs->ptr_shift = fs->block_shift - 2;
 
 	if (sb->frag_size_log > 63 - 10) goto err;
 	fs->frag_size = 1024 << sb->frag_size_log;
 
 	fs->inodes_per_group = sb->inodes_per_group;
 	fs->blocks_per_group = sb->blocks_per_group;
+	fs->ipg = divisor(sb->inodes_per_group);
+	fs->bpg = divisor(sb->blocks_per_group);
 	fs->inode_size = sb->inode_size;
+	fs->first_data_block = sb->block_first_data;
 	ext2_dropreq(fs, sb, false);
 
+	fs->zeroes = calloc(1, fs->block_size);
+	if (!fs->zeroes)
+		goto err_nosb;
+
+	fs->group_locks = malloc(fs->groups * sizeof *fs->group_locks);
+	if (!fs->group_locks) {
+		free(fs->zeroes);
+		goto err_nosb;
+	}
+	for (uint32_t i = 0; i < fs->groups; i++) {
+		pthread_mutex_init(&fs->group_locks[i], NULL);
+	}
+	for (int i = 0; i < EXT2_INODE_LOCKS; i++) {
+		pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	}
+	pthread_mutex_init(&fs->orphan_lock, NULL);
+	pthread_mutex_init(&fs->sb_lock, NULL);
+	pthread_mutex_init(&fs->icache.lock, NULL);
+	pthread_cond_init(&fs->icache.cond, NULL);
+	pthread_mutex_init(&fs->trace.lock, NULL);
+	pthread_mutex_init(&fs->resv.lock, NULL);
+
+	if (ext2i_icache_init(fs, ICACHE_SIZE) < 0) {
+		ext2_free(fs);
+		return NULL;
+	}
+
 	return fs;
 err:
 	if (sb) {
 		ext2_dropreq(fs, sb, false);
 	}
+err_nosb:
 	free(fs);
 	return NULL;
 }
@@ -62,11 +109,40 @@ void
 ext2_free(struct ext2 *fs)
 {
 	if (!fs) return;
+	ext2_sync(fs);
+	free(fs->icache.ents);
+	for (uint32_t i = 0; i < fs->groups; i++) {
+		pthread_mutex_destroy(&fs->group_locks[i]);
+	}
+	free(fs->group_locks);
+	for (int i = 0; i < EXT2_INODE_LOCKS; i++) {
+		pthread_rwlock_destroy(&fs->inode_locks[i]);
+	}
+	pthread_mutex_destroy(&fs->orphan_lock);
+	pthread_mutex_destroy(&fs->sb_lock);
+	pthread_mutex_destroy(&fs->icache.lock);
+	pthread_cond_destroy(&fs->icache.cond);
+	pthread_mutex_destroy(&fs->trace.lock);
+	pthread_mutex_destroy(&fs->resv.lock);
+	free(fs->trace.active);
+	free(fs->zeroes);
 	free(fs);
 }
 
-static uint32_t
-ext2_default_gettime32(struct e2device *dev)
+void
+ext2_setreqh(struct ext2 *fs, e2device_reqh fn)
+{
+	fs->reqh = fn;
+}
+
+void
+ext2_setro(struct ext2 *fs)
+{
+	fs->rw = false;
+}
+
+uint32_t
+ext2i_default_gettime32(struct e2device *dev)
 {
 	(void)dev;
 	return ~0;
@@ -1,23 +1,25 @@
 #include "ext2.h"
 #include <limits.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 int
 ext2_inode_ondisk(struct ext2 *fs, uint32_t inode_n, size_t pos, size_t *dev_off, size_t *dev_len)
 {
-	// TODO unnecessary division by power of 2
-	uint64_t block     = pos / fs->block_size;
-	uint64_t block_off = pos % fs->block_size;
+	uint64_t block     = pos >> fs->block_shift;
+	uint64_t block_off = pos & fs->block_mask;
 	uint32_t *blocks;
-	size_t blocks_len;
+	size_t blocks_len, hole;
 
 	blocks = ext2_req_blockmap(fs, inode_n, &blocks_len, block, false);
 	if (!blocks) return -1;
 	block = blocks[0];
-	fs->drop(fs->dev, blocks, false);
+	for (hole = 0; hole < blocks_len && blocks[hole] == 0; hole++);
+	ext2_dropreq(fs, blocks, false);
 	if (block == 0) {
-		return -1;
+		*dev_len = hole * fs->block_size - block_off;
+		return 1;
 	}
 
 	*dev_off = block * fs->block_size + block_off;
@@ -30,9 +32,12 @@ int
 ext2_read(struct ext2 *fs, uint32_t inode_n, void *buf, size_t len, size_t off)
 {
 	size_t pos = 0;
+	pthread_rwlock_rdlock(ext2i_inode_lock(fs, inode_n));
 	while (pos < len) {
 		size_t part_len = len - pos;
-		void *p = ext2_req_file(fs, inode_n, &part_len, off + pos);
+		/* anything past the current block will get requested next */
+		unsigned hint = part_len > fs->block_size ? E2HintSeq : 0;
+		void *p = ext2i_req_file(fs, Ext2SiteFile, hint, inode_n, &part_len, off + pos);
 		if (!p) {
 			break;
 		}
@@ -40,6 +45,10 @@ ext2_read(struct ext2 *fs, uint32_t inode_n, void *buf, size_t len, size_t off)
 		ext2_dropreq(fs, p, false);
 		pos += part_len;
 	}
+	if (pos > 0) {
+		ext2i_touch(fs, inode_n, Ext2TouchA);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
 	return pos;
 }
 
@@ -57,10 +66,11 @@ ext2_diriter(struct ext2_diriter *iter, struct ext2 *fs, uint32_t inode_n)
 	if (iter_int.needs_reset)
 		return false;
 
+	pthread_rwlock_rdlock(ext2i_inode_lock(fs, inode_n));
 	for (;;) {
 		len = sizeof(*ent) + 256;
-		ent = ext2_req_file(fs, inode_n, &len, iter_int.pos);
-		if (!ent || len < sizeof(*ent)) {
+		ent = ext2i_req_file(fs, Ext2SiteDirent, E2HintSeq, inode_n, &len, iter_int.pos);
+		if (!ent || len < sizeof(*ent) || ent->size == 0) {
 			break;
 		}
 		iter_int.pos += ent->size;
@@ -71,6 +81,7 @@ ext2_diriter(struct ext2_diriter *iter, struct ext2 *fs, uint32_t inode_n)
 			memcpy(iter_int.buf, ent, sizeof(*ent) + ent->namelen_lower);
 			iter->ent = (void*)iter_int.buf;
 			ext2_dropreq(fs, ent, false);
+			pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
 			return true;
 		}
 		ext2_dropreq(fs, ent, false);
@@ -80,11 +91,83 @@ ext2_diriter(struct ext2_diriter *iter, struct ext2 *fs, uint32_t inode_n)
 	if (ent) {
 		ext2_dropreq(fs, ent, false);
 	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
 	iter_int.needs_reset = true;
 	return false;
 #undef iter_int
 }
 
+int
+ext2_bulkstat(struct ext2 *fs, uint32_t group, uint32_t start, uint32_t count,
+		ext2_bulkstatfn fn, void *userdata)
+{
+	const uint32_t per = fs->block_size / fs->inode_size; /* per table block */
+	uint8_t *bitmap = NULL;
+	char *table = NULL;
+	uint32_t itable, end;
+	int n = 0, ret = -1;
+	if (group >= fs->groups || start >= fs->inodes_per_group) return -1;
+	end = count < fs->inodes_per_group - start ? start + count : fs->inodes_per_group;
+	{
+		struct ext2d_bgd *bgd = ext2_req_bgdt(fs, group);
+		if (!bgd) return -1;
+		itable = bgd->inode_table;
+		ext2_dropreq(fs, bgd, false);
+	}
+
+	/* Both get copied out, so that fn runs without any active requests. */
+	bitmap = malloc(fs->block_size);
+	table = malloc(fs->block_size);
+	if (!bitmap || !table) goto out;
+	{
+		void *p = ext2_req_bitmap(fs, group, Ext2Inode);
+		if (!p) goto out;
+		memcpy(bitmap, p, fs->block_size);
+		ext2_dropreq(fs, p, false);
+	}
+
+	for (uint32_t idx = start; idx < end; ) {
+		uint32_t next = (idx / per + 1) * per;
+		uint32_t i;
+		if (next > end) next = end;
+		for (i = idx; i < next && !(bitmap[i / 8] & (1 << (i % 8))); i++);
+		if (i < next) {
+			uint64_t pos = (itable + (uint64_t)idx / per) * fs->block_size;
+			void *p = ext2i_reqh(fs, Ext2SiteInode, E2HintSeq, 0, fs->block_size, pos);
+			if (!p) goto out;
+			memcpy(table, p, fs->block_size);
+			ext2_dropreq(fs, p, false);
+		}
+		for (; i < next; i++) {
+			uint32_t inode_n = group * fs->inodes_per_group + i + 1;
+			const struct ext2d_inode *inode = (void*)(table + i % per * fs->inode_size);
+			struct ext2d_inode cached;
+			bool hit;
+			if (!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+			/* The cached copy might have changes that weren't written
+			 * back. Its writers hold the inode lock while changing it,
+			 * so that keeps the copy from being torn. */
+			pthread_rwlock_rdlock(ext2i_inode_lock(fs, inode_n));
+			hit = ext2i_icache_peek(fs, inode_n, &cached);
+			pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
+			if (hit) {
+				inode = &cached;
+			}
+			n++;
+			if (fn(userdata, inode_n, inode) != 0) {
+				ret = n;
+				goto out;
+			}
+		}
+		idx = next;
+	}
+	ret = n;
+out:
+	free(bitmap);
+	free(table);
+	return ret;
+}
+
 uint32_t
 ext2c_walk(struct ext2 *fs, const char *path, size_t plen)
 {
@@ -4,34 +4,41 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-static int ext2_inodepos(struct ext2 *fs, uint32_t inode);
+static uint32_t alloc_indirect(struct ext2 *fs, uint32_t inode_n);
 
-static int
-ext2_inodepos(struct ext2 *fs, uint32_t inode)
+int
+ext2i_inodepos(struct ext2 *fs, uint32_t inode_n, uint64_t *pos)
 {
 	struct ext2d_bgd *bgd;
-	int ret = -1;
-	uint32_t group = (inode - 1) / fs->inodes_per_group;
-	uint32_t idx   = (inode - 1) % fs->inodes_per_group;
-	if (group >= fs->groups) return -1;
+	uint32_t group = ext2i_div(fs->ipg, inode_n - 1);
+	uint32_t idx   = ext2i_mod(fs->ipg, inode_n - 1);
+	if (inode_n == 0 || group >= fs->groups) return -1;
 	bgd = ext2_req_bgdt(fs, group);
-	if (bgd) {
-		ret = fs->block_size * bgd->inode_table + idx * fs->inode_size;
-		ext2_dropreq(fs, bgd, false);
-	}
-	return ret;
+	if (!bgd) return -1;
+	*pos = fs->block_size * bgd->inode_table + idx * fs->inode_size;
+	ext2_dropreq(fs, bgd, false);
+	return 0;
 }
 
 struct ext2d_inode *
 ext2_req_inode(struct ext2 *fs, uint32_t inode_n)
 {
-	int off = ext2_inodepos(fs, inode_n);
-	if (off < 0) return NULL;
-	return fs->req(fs->dev, sizeof(struct ext2d_inode), off);
+	uint64_t pos;
+	if (fs->icache.len > 0) {
+		return ext2i_icache_get(fs, inode_n);
+	}
+	if (ext2i_inodepos(fs, inode_n, &pos) < 0) return NULL;
+	return ext2i_req(fs, Ext2SiteInode, inode_n, sizeof(struct ext2d_inode), pos);
 }
 
 void *
 ext2_req_file(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off)
+{
+	return ext2i_req_file(fs, Ext2SiteFile, 0, inode_n, len, off);
+}
+
+void *
+ext2i_req_file(struct ext2 *fs, enum ext2_site site, unsigned hint, uint32_t inode_n, size_t *len, size_t off)
 {
 	uint64_t dev_off, dev_len;
 	size_t size, og_len = *len;
@@ -45,7 +52,18 @@ ext2_req_file(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off)
 		*len = 0;
 		return NULL;
 	}
-	if (ext2_inode_ondisk(fs, inode_n, off, &dev_off, &dev_len) < 0) {
+	switch (ext2_inode_ondisk(fs, inode_n, off, &dev_off, &dev_len)) {
+	case 0:
+		break;
+	case 1:
+		/* a hole, doesn't need the device */
+		*len = fs->block_size - (off & fs->block_mask);
+		if (*len > size - off)
+			*len = size - off;
+		if (og_len && *len > og_len)
+			*len = og_len;
+		return fs->zeroes;
+	default:
 		return NULL;
 	}
 	*len = dev_len;
@@ -53,7 +71,7 @@ ext2_req_file(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off)
 		*len = size - off;
 	if (og_len && *len > og_len)
 		*len = og_len;
-	return fs->req(fs->dev, *len, dev_off);
+	return ext2i_reqh(fs, site, hint, inode_n, *len, dev_off);
 }
 
 struct ext2d_bgd *
@@ -62,13 +80,14 @@ ext2_req_bgdt(struct ext2 *fs, uint32_t idx)
 	size_t block;
 	if (!(idx < fs->groups)) return NULL;
 	block = fs->block_size == 1024 ? 2 : 1;
-	return fs->req(fs->dev, sizeof(struct ext2d_bgd), block * fs->block_size);
+	return ext2i_req(fs, Ext2SiteBgdt, 0, sizeof(struct ext2d_bgd),
+		block * fs->block_size + idx * sizeof(struct ext2d_bgd));
 }
 
 struct ext2d_superblock *
 ext2_req_sb(struct ext2 *fs)
 {
-	return fs->req(fs->dev, sizeof (struct ext2d_superblock), 1024);
+	return ext2i_req(fs, Ext2SiteSb, 0, sizeof (struct ext2d_superblock), 1024);
 }
 
 void *
@@ -86,7 +105,7 @@ ext2_req_bitmap(struct ext2 *fs, uint32_t group, enum ext2_bitmap type)
 		b_addr = bgd->block_bitmap;
 	}
 	ext2_dropreq(fs, bgd, false);
-	return fs->req(fs->dev, fs->block_size, fs->block_size * b_addr);
+	return ext2i_req(fs, Ext2SiteBitmap, 0, fs->block_size, fs->block_size * b_addr);
 }
 
 uint32_t *
@@ -94,39 +113,104 @@ ext2_req_blockmap(struct ext2 *fs, uint32_t inode_n, size_t *len, uint32_t off,
 {
 	if (alloc && !fs->rw) return NULL;
 	if (off < 12) {
-		int ioff = ext2_inodepos(fs, inode_n);
-		if (ioff < 0) return NULL;
-
+		uint64_t ipos;
 		*len = 12 - off;
 		assert(*len > 0);
-		return fs->req(fs->dev, *len * 4, ioff + offsetof(struct ext2d_inode, block) + 4 * off);
-	} else if (off - 12 < fs->block_size / 4) {
-		uint32_t indirect;
-
+		if (fs->icache.len > 0) {
+			/* ext2_dropreq also accepts pointers into the middle of a cached inode */
+			char *inode = (void*)ext2i_icache_get(fs, inode_n);
+			if (!inode) return NULL;
+			return (uint32_t*)(inode + offsetof(struct ext2d_inode, block)) + off;
+		}
+		if (ext2i_inodepos(fs, inode_n, &ipos) < 0) return NULL;
+		return ext2i_req(fs, Ext2SiteBlockmap, inode_n, *len * 4, ipos + offsetof(struct ext2d_inode, block) + 4 * off);
+	} else {
+		const uint64_t per = (uint64_t)1 << fs->ptr_shift;
+		uint64_t rel = off - 12;
+		unsigned span_shift = fs->ptr_shift; /* log2 of the blocks under ptr */
+		uint32_t ptr;
+		int depth;
 		struct ext2d_inode *inode;
+
+		/* find the tree and the offset within it */
+		for (depth = 1; rel >= (uint64_t)1 << span_shift; depth++) {
+			if (depth == 3) return NULL;
+			rel -= (uint64_t)1 << span_shift;
+			span_shift += fs->ptr_shift;
+		}
+
 		inode = ext2_req_inode(fs, inode_n);
 		if (!inode) return NULL;
-		indirect = inode->indirect_1;
+		ptr = depth == 1 ? inode->indirect_1
+		    : depth == 2 ? inode->indirect_2
+		    : inode->indirect_3;
 		ext2_dropreq(fs, inode, false);
-
-		if (indirect == 0) {
-			if (!alloc) return NULL;
-			indirect = ext2_alloc_block(fs);
-			if (indirect == 0) return NULL;
+		if (ptr == 0) {
+			if (!alloc) {
+				*len = per - (rel & (per - 1));
+				return (uint32_t*)fs->zeroes;
+			}
+			ptr = alloc_indirect(fs, inode_n);
+			if (ptr == 0) return NULL;
 
 			inode = ext2_req_inode(fs, inode_n);
 			if (!inode) return NULL;
-			inode->indirect_1 = indirect;
+			if (depth == 1) inode->indirect_1 = ptr;
+			else if (depth == 2) inode->indirect_2 = ptr;
+			else inode->indirect_3 = ptr;
 			if (ext2_dropreq(fs, inode, true) < 0) {
 				return NULL;
 			}
 		}
 
-		off -= 12;
-		*len = fs->block_size / 4 - off;
+		/* descend to the single indirect block containing off */
+		for (; depth > 1; depth--) {
+			uint64_t pos;
+			uint32_t *ent, next;
+			span_shift -= fs->ptr_shift;
+			pos = ((uint64_t)ptr << fs->block_shift) + (rel >> span_shift) * 4;
+			rel &= ((uint64_t)1 << span_shift) - 1;
+
+			ent = ext2i_req(fs, Ext2SiteBlockmap, inode_n, 4, pos);
+			if (!ent) return NULL;
+			next = *ent;
+			ext2_dropreq(fs, ent, false);
+			if (next == 0) {
+				if (!alloc) {
+					*len = per - (rel & (per - 1));
+					return (uint32_t*)fs->zeroes;
+				}
+				next = alloc_indirect(fs, inode_n);
+				if (next == 0) return NULL;
+
+				ent = ext2i_req(fs, Ext2SiteBlockmap, inode_n, 4, pos);
+				if (!ent) return NULL;
+				*ent = next;
+				if (ext2_dropreq(fs, ent, true) < 0) {
+					return NULL;
+				}
+			}
+			ptr = next;
+		}
+
+		*len = per - rel;
 		assert(*len > 0);
-		return fs->req(fs->dev, *len * 4, indirect * fs->block_size + off * 4);
-	} else {
-		return NULL;
+		return ext2i_req(fs, Ext2SiteBlockmap, inode_n, *len * 4, (uint64_t)ptr * fs->block_size + rel * 4);
+	}
+}
+
+/* Allocates a zeroed block for the inode's block map. */
+static uint32_t
+alloc_indirect(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2d_inode *inode;
+	uint32_t block = ext2_alloc_block(fs);
+	if (block == 0) return 0;
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return 0;
+	inode->sectors += fs->block_size / 512;
+	if (ext2_dropreq(fs, inode, true) < 0) {
+		return 0;
 	}
+	return block;
 }
@@ -0,0 +1,139 @@
+/* Per-inode reservation windows.
+ * When a file grows at its end, the allocator grabs a few more blocks than
+ * needed and remembers the surplus here, together with the file block it
+ * would continue. The next append to that file takes its blocks from the
+ * window, so files written in small pieces (or by several writers at once)
+ * still end up contiguous. The window doubles every time it gets refilled.
+ * Reserved blocks are marked as used in the bitmaps, but don't belong to any
+ * inode, and don't get zeroed, until they're taken. They get freed again when
+ * the slot is needed for another inode, when the file shrinks, by ext2_sync,
+ * and all at once when the allocator finds no free block anywhere else.
+ * The table is protected by resv.lock, which is never held while calling into
+ * anything else. */
+
+#include "ext2.h"
+#include <string.h>
+
+#define RESV_MIN 8 /* blocks */
+#define RESV_MAX 1024
+
+static struct ext2i_resv *find(struct ext2 *fs, uint32_t inode_n);
+
+static struct ext2i_resv *
+find(struct ext2 *fs, uint32_t inode_n)
+{
+	for (size_t i = 0; i < EXT2_RESV_SLOTS; i++) {
+		if (fs->resv.ents[i].inode_n == inode_n) {
+			return &fs->resv.ents[i];
+		}
+	}
+	return NULL;
+}
+
+uint32_t
+ext2i_resv_take(struct ext2 *fs, uint32_t inode_n, uint32_t iblock, uint32_t want, uint32_t *got)
+{
+	struct ext2i_resv *r;
+	uint32_t block = 0;
+	*got = 0;
+	pthread_mutex_lock(&fs->resv.lock);
+	r = find(fs, inode_n);
+	if (r && r->iblock == iblock && r->len > 0) {
+		*got = want < r->len ? want : r->len;
+		block = r->start;
+		r->start += *got;
+		r->len -= *got;
+		r->iblock += *got;
+		r->lastuse = ++fs->resv.clock;
+	}
+	pthread_mutex_unlock(&fs->resv.lock);
+	return block;
+}
+
+uint32_t
+ext2i_resv_window(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_resv *r;
+	uint32_t win = RESV_MIN;
+	pthread_mutex_lock(&fs->resv.lock);
+	r = find(fs, inode_n);
+	if (r && r->win > 0) {
+		win = r->win * 2 < RESV_MAX ? r->win * 2 : RESV_MAX;
+	}
+	pthread_mutex_unlock(&fs->resv.lock);
+	if (win > fs->blocks_per_group / 8) {
+		win = fs->blocks_per_group / 8;
+	}
+	return win;
+}
+
+int
+ext2i_resv_put(struct ext2 *fs, uint32_t inode_n, uint32_t iblock, uint32_t block, uint32_t len, uint32_t win)
+{
+	struct ext2i_resv *r;
+	uint32_t old_start = 0, old_len = 0;
+	pthread_mutex_lock(&fs->resv.lock);
+	r = find(fs, inode_n);
+	if (!r) {
+		/* a free slot, or the least recently used one */
+		r = &fs->resv.ents[0];
+		for (size_t i = 0; i < EXT2_RESV_SLOTS; i++) {
+			struct ext2i_resv *c = &fs->resv.ents[i];
+			if (c->inode_n == 0) {
+				r = c;
+				break;
+			}
+			if (c->lastuse < r->lastuse) {
+				r = c;
+			}
+		}
+	}
+	old_start = r->start;
+	old_len = r->len;
+	r->inode_n = inode_n;
+	r->iblock = iblock;
+	r->start = block;
+	r->len = len;
+	r->win = win;
+	r->lastuse = ++fs->resv.clock;
+	pthread_mutex_unlock(&fs->resv.lock);
+	if (old_len > 0) {
+		return ext2i_free_blocks(fs, old_start, old_len);
+	}
+	return 0;
+}
+
+int
+ext2i_resv_release(struct ext2 *fs, uint32_t inode_n)
+{
+	struct ext2i_resv *r;
+	uint32_t start = 0, len = 0;
+	pthread_mutex_lock(&fs->resv.lock);
+	r = find(fs, inode_n);
+	if (r) {
+		start = r->start;
+		len = r->len;
+		memset(r, 0, sizeof *r);
+	}
+	pthread_mutex_unlock(&fs->resv.lock);
+	if (len > 0) {
+		return ext2i_free_blocks(fs, start, len);
+	}
+	return 0;
+}
+
+int
+ext2i_resv_release_all(struct ext2 *fs)
+{
+	int ret = 0;
+	for (size_t i = 0; i < EXT2_RESV_SLOTS; i++) {
+		uint32_t inode_n;
+		pthread_mutex_lock(&fs->resv.lock);
+		inode_n = fs->resv.ents[i].inode_n;
+		pthread_mutex_unlock(&fs->resv.lock);
+		if (inode_n != 0 && ext2i_resv_release(fs, inode_n) < 0) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,83 @@
+/* Request tracing.
+ * Drops only carry a pointer, so while tracing is enabled every request is
+ * remembered until it gets dropped, and the drop gets reported with the same
+ * site, inode and location. */
+
+#include "ext2.h"
+#include <stdlib.h>
+#include <string.h>
+
+void
+ext2_settrace(struct ext2 *fs, ext2_tracefn fn, void *userdata)
+{
+	pthread_mutex_lock(&fs->trace.lock);
+	fs->trace.fn = fn;
+	fs->trace.userdata = userdata;
+	fs->trace.len = 0;
+	pthread_mutex_unlock(&fs->trace.lock);
+}
+
+void
+ext2i_trace_req(struct ext2 *fs, enum ext2_site site, uint32_t inode_n, void *ptr, size_t len, size_t off)
+{
+	struct ext2_trace t = {
+		.site = site,
+		.drop = false,
+		.dirty = false,
+		.inode_n = inode_n,
+		.off = off,
+		.len = len,
+		.ptr = ptr,
+	};
+	if (ptr) {
+		pthread_mutex_lock(&fs->trace.lock);
+		if (fs->trace.len == fs->trace.cap) {
+			size_t cap = fs->trace.cap ? fs->trace.cap * 2 : 16;
+			struct ext2i_trace_ent *a = realloc(fs->trace.active, cap * sizeof *a);
+			if (a) {
+				fs->trace.active = a;
+				fs->trace.cap = cap;
+			}
+		}
+		/* if that failed, the drop just gets reported without the details */
+		if (fs->trace.len < fs->trace.cap) {
+			struct ext2i_trace_ent *e = &fs->trace.active[fs->trace.len++];
+			e->ptr = ptr;
+			e->site = site;
+			e->inode_n = inode_n;
+			e->off = off;
+			e->len = len;
+		}
+		pthread_mutex_unlock(&fs->trace.lock);
+	}
+	fs->trace.fn(fs->trace.userdata, &t);
+}
+
+void
+ext2i_trace_drop(struct ext2 *fs, void *ptr, bool dirty)
+{
+	struct ext2_trace t = {
+		.site = Ext2SiteFile,
+		.drop = true,
+		.dirty = dirty,
+		.inode_n = 0,
+		.off = 0,
+		.len = 0,
+		.ptr = ptr,
+	};
+	pthread_mutex_lock(&fs->trace.lock);
+	/* overlapping requests can share a pointer, take the newest one */
+	for (size_t i = fs->trace.len; i-- > 0; ) {
+		struct ext2i_trace_ent *e = &fs->trace.active[i];
+		if (e->ptr == ptr) {
+			t.site = e->site;
+			t.inode_n = e->inode_n;
+			t.off = e->off;
+			t.len = e->len;
+			memmove(e, e + 1, (--fs->trace.len - i) * sizeof *e);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->trace.lock);
+	fs->trace.fn(fs->trace.userdata, &t);
+}
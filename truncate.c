@@ -0,0 +1,322 @@
+/* Functions for changing the size of files and freeing their blocks. */
+
+#include "ext2.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FREEBATCH 128
+
+/* Blocks waiting to be marked as free. Flushing a batch touches each involved
+ * bitmap and BGD once, and the superblock once. */
+struct freebatch {
+	uint32_t blocks[FREEBATCH];
+	size_t len;
+	uint32_t total; /* freed by all flushes, including the pending ones */
+	uint32_t inode_n; /* whose blocks those are */
+};
+
+static int batch_flush(struct ext2 *fs, struct freebatch *b);
+static int batch_add(struct ext2 *fs, struct freebatch *b, uint32_t block);
+static int free_tree(struct ext2 *fs, struct freebatch *b, uint32_t block,
+		int depth, uint64_t base, uint64_t keep, bool *emptied);
+static int zero_tail(struct ext2 *fs, uint32_t inode_n, size_t size);
+
+static int
+batch_flush(struct ext2 *fs, struct freebatch *b)
+{
+	uint32_t flushed = 0;
+	int ret = 0;
+	while (b->len > 0) {
+		uint32_t group = ext2i_div(fs->bpg, b->blocks[0] - fs->first_data_block);
+		uint32_t cnt = 0;
+		uint8_t *bitmap;
+		pthread_mutex_lock(&fs->group_locks[group]);
+		bitmap = ext2_req_bitmap(fs, group, Ext2Block);
+		if (!bitmap) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
+			return -1;
+		}
+		for (size_t i = 0; i < b->len; ) {
+			uint32_t rel = b->blocks[i] - fs->first_data_block;
+			uint32_t idx = ext2i_mod(fs->bpg, rel);
+			if (ext2i_div(fs->bpg, rel) != group) {
+				i++;
+				continue;
+			}
+			if (idx / 8 < fs->block_size && (bitmap[idx / 8] & (1 << (idx % 8)))) {
+				bitmap[idx / 8] &= ~(1 << (idx % 8));
+				cnt++;
+			} else {
+				// TODO fs potentially FUBAR
+				ret = -1;
+			}
+			b->blocks[i] = b->blocks[--b->len];
+		}
+		if (ext2_dropreq(fs, bitmap, cnt > 0) < 0) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
+			return -1;
+		}
+		if (cnt == 0) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
+			continue;
+		}
+
+		struct ext2d_bgd *bgd = ext2_req_bgdt(fs, group);
+		if (!bgd) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
+			return -1;
+		}
+		bgd->blocks_free += cnt;
+		if (ext2_dropreq(fs, bgd, true) < 0) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
+			return -1;
+		}
+		pthread_mutex_unlock(&fs->group_locks[group]);
+		flushed += cnt;
+	}
+	if (flushed > 0) {
+		struct ext2d_superblock *sb;
+		pthread_mutex_lock(&fs->sb_lock);
+		sb = ext2_req_sb(fs);
+		if (!sb) {
+			pthread_mutex_unlock(&fs->sb_lock);
+			return -1;
+		}
+		sb->blocks_free += flushed;
+		if (ext2_dropreq(fs, sb, true) < 0) {
+			ret = -1;
+		}
+		pthread_mutex_unlock(&fs->sb_lock);
+	}
+	return ret;
+}
+
+static int
+batch_add(struct ext2 *fs, struct freebatch *b, uint32_t block)
+{
+	if (b->len == FREEBATCH && batch_flush(fs, b) < 0) {
+		return -1;
+	}
+	b->blocks[b->len++] = block;
+	b->total++;
+	return 0;
+}
+
+/* Frees every block of the subtree rooted at block that maps file blocks past
+ * keep. depth is 0 for data blocks, 1 for single indirect blocks, etc.
+ * base is the index of the first file block covered by the subtree.
+ * Sets *emptied if block itself got freed. */
+static int
+free_tree(struct ext2 *fs, struct freebatch *b, uint32_t block,
+		int depth, uint64_t base, uint64_t keep, bool *emptied)
+{
+	const uint64_t per = fs->block_size / 4;
+	uint64_t child_span = 1;
+	uint32_t *ptrs;
+	bool changed = false;
+	int ret = 0;
+
+	*emptied = false;
+	if (depth == 0) {
+		if (base < keep) return 0;
+		*emptied = true;
+		return batch_add(fs, b, block);
+	}
+	for (int i = 1; i < depth; i++) {
+		child_span *= per;
+	}
+
+	/* Only one request may be active at a time, so the pointers have to be
+	 * copied out before descending. */
+	ptrs = malloc(fs->block_size);
+	if (!ptrs) {
+		return -1;
+	}
+	{
+		void *p = ext2i_req(fs, Ext2SiteBlockmap, b->inode_n, fs->block_size, (uint64_t)block * fs->block_size);
+		if (!p) {
+			free(ptrs);
+			return -1;
+		}
+		memcpy(ptrs, p, fs->block_size);
+		ext2_dropreq(fs, p, false);
+	}
+
+	for (uint64_t i = 0; i < per; i++) {
+		uint64_t child_base = base + i * child_span;
+		bool child_emptied;
+		if (ptrs[i] == 0) continue;
+		if (child_base + child_span <= keep) continue;
+		if (free_tree(fs, b, ptrs[i], depth - 1, child_base, keep, &child_emptied) < 0) {
+			ret = -1;
+			break;
+		}
+		if (child_emptied) {
+			ptrs[i] = 0;
+			changed = true;
+		}
+	}
+
+	if (ret == 0 && base >= keep) {
+		*emptied = true;
+		ret = batch_add(fs, b, block);
+	} else if (changed) {
+		void *p = ext2i_req(fs, Ext2SiteBlockmap, b->inode_n, fs->block_size, (uint64_t)block * fs->block_size);
+		if (!p) {
+			ret = -1;
+		} else {
+			memcpy(p, ptrs, fs->block_size);
+			if (ext2_dropreq(fs, p, true) < 0) {
+				ret = -1;
+			}
+		}
+	}
+	free(ptrs);
+	return ret;
+}
+
+/* Zeroes the part of the last block past size, so it doesn't resurface if
+ * the file grows again. */
+static int
+zero_tail(struct ext2 *fs, uint32_t inode_n, size_t size)
+{
+	size_t dev_off, dev_len;
+	void *p;
+	int ret;
+	if ((size & fs->block_mask) == 0) return 0;
+	ret = ext2_inode_ondisk(fs, inode_n, size, &dev_off, &dev_len);
+	if (ret != 0) {
+		return ret < 0 ? -1 : 0; /* a hole, nothing to zero */
+	}
+	p = ext2i_req(fs, Ext2SiteFile, inode_n, dev_len, dev_off);
+	if (!p) return -1;
+	memset(p, 0, dev_len);
+	return ext2_dropreq(fs, p, true);
+}
+
+int
+ext2i_free_blocks(struct ext2 *fs, uint32_t block, uint32_t len)
+{
+	struct freebatch *b;
+	int ret = 0;
+	b = malloc(sizeof *b);
+	if (!b) return -1;
+	b->len = 0;
+	b->total = 0;
+	b->inode_n = 0;
+	for (uint32_t i = 0; i < len && ret == 0; i++) {
+		ret = batch_add(fs, b, block + i);
+	}
+	if (batch_flush(fs, b) < 0) {
+		ret = -1;
+	}
+	free(b);
+	return ret;
+}
+
+int
+ext2_truncate(struct ext2 *fs, uint32_t inode_n, size_t new_size)
+{
+	int ret;
+	if (!fs->rw) return -1;
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, inode_n));
+	ret = ext2i_truncate(fs, inode_n, new_size);
+	if (ret == 0) {
+		ext2i_touch(fs, inode_n, Ext2TouchM | Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
+	return ret;
+}
+
+int
+ext2i_truncate(struct ext2 *fs, uint32_t inode_n, size_t new_size)
+{
+	const uint64_t per = fs->block_size / 4;
+	struct ext2d_inode *inode;
+	struct freebatch *b;
+	uint32_t block[12], indirect[3];
+	uint64_t keep, base;
+	size_t size;
+	int ret = 0;
+
+	if (!fs->rw) return -1;
+	if ((uint32_t)new_size != new_size) return -1;
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return -1;
+	size = inode->size_lower;
+	memcpy(block, inode->block, sizeof block);
+	indirect[0] = inode->indirect_1;
+	indirect[1] = inode->indirect_2;
+	indirect[2] = inode->indirect_3;
+	ext2_dropreq(fs, inode, false);
+
+	if (new_size > size) {
+		/* the new area is a hole, the tail of the old last block is
+		 * already zeroed */
+		inode = ext2_req_inode(fs, inode_n);
+		if (!inode) return -1;
+		inode->size_lower = new_size;
+		return ext2_dropreq(fs, inode, true);
+	}
+
+	/* the window would continue past the new end */
+	if (ext2i_resv_release(fs, inode_n) < 0) {
+		return -1;
+	}
+	if (new_size < size && zero_tail(fs, inode_n, new_size) < 0) {
+		return -1;
+	}
+
+	b = malloc(sizeof *b);
+	if (!b) return -1;
+	b->len = 0;
+	b->total = 0;
+	b->inode_n = inode_n;
+
+	/* If this fails midway, the inode may keep references to already freed
+	 * blocks. The caller should retry. */
+	keep = (new_size + fs->block_mask) >> fs->block_shift;
+	for (uint64_t i = keep; i < 12 && ret == 0; i++) {
+		if (block[i] == 0) continue;
+		ret = batch_add(fs, b, block[i]);
+		block[i] = 0;
+	}
+	base = 12;
+	for (int depth = 1; depth <= 3 && ret == 0; depth++) {
+		uint64_t span = 1;
+		bool emptied;
+		for (int i = 0; i < depth; i++) {
+			span *= per;
+		}
+		if (indirect[depth - 1] != 0 && keep < base + span) {
+			ret = free_tree(fs, b, indirect[depth - 1], depth, base, keep, &emptied);
+			if (ret == 0 && emptied) {
+				indirect[depth - 1] = 0;
+			}
+		}
+		base += span;
+	}
+	if (batch_flush(fs, b) < 0) {
+		ret = -1;
+	}
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) {
+		free(b);
+		return -1;
+	}
+	memcpy(inode->block, block, sizeof block);
+	inode->indirect_1 = indirect[0];
+	inode->indirect_2 = indirect[1];
+	inode->indirect_3 = indirect[2];
+	if (ret == 0) {
+		inode->size_lower = new_size;
+	}
+	inode->sectors -= b->total * (fs->block_size / 512);
+	if (ext2_dropreq(fs, inode, true) < 0) {
+		ret = -1;
+	}
+	free(b);
+	return ret;
+}
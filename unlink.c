@@ -6,24 +6,76 @@
 
 #define DIRENT_SIZE(namelen) ((sizeof(struct ext2d_dirent) + namelen + 3) & ~3)
 
+static int dirent_add(struct ext2 *fs, uint32_t dir_n, const char *name, uint32_t target_n, int flags);
+static uint32_t dirent_remove(struct ext2 *fs, uint32_t dir_n, const char *name);
 static int bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type);
-static int nuke_inode(struct ext2 *fs, uint32_t inode_n);
+static int orphan_add(struct ext2 *fs, uint32_t inode_n);
+static int orphan_head(struct ext2 *fs, uint32_t *inode_n);
+static int reclaim_locked(struct ext2 *fs, uint32_t inode_n, uint32_t *budget);
 
 int
 ext2_link(struct ext2 *fs, uint32_t dir_n, const char *name, uint32_t target_n, int flags)
 {
-	size_t len = 0;
-	void *dir;
-	size_t namelen = strlen(name);
-	size_t entlen = DIRENT_SIZE(namelen);
+	int ret;
 	if (!fs->rw) return -1;
-	if ((uint8_t)namelen != namelen) {
+	if ((uint8_t)strlen(name) != strlen(name)) {
 		return -1;
 	}
-	if (ext2i_change_linkcnt(fs, target_n, 1) < 0) {
+	/* The locks are taken one after another, never nested - the target and
+	 * the directory might share a lock stripe. */
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, target_n));
+	ret = ext2i_change_linkcnt(fs, target_n, 1);
+	if (ret == 0) {
+		ext2i_touch(fs, target_n, Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, target_n));
+	if (ret < 0) {
 		return -1;
 	}
-	dir = ext2_req_file(fs, dir_n, &len, 0);
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, dir_n));
+	ret = dirent_add(fs, dir_n, name, target_n, flags);
+	if (ret == 0) {
+		ext2i_touch(fs, dir_n, Ext2TouchM | Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, dir_n));
+	return ret;
+}
+
+uint32_t
+ext2_unlink(struct ext2 *fs, uint32_t dir_n, const char *name)
+{
+	uint32_t n;
+	int ret;
+	if (!fs->rw) return 0;
+	if ((uint8_t)strlen(name) != strlen(name)) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, dir_n));
+	n = dirent_remove(fs, dir_n, name);
+	if (n != 0) {
+		ext2i_touch(fs, dir_n, Ext2TouchM | Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, dir_n));
+	if (n == 0) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, n));
+	ret = ext2i_change_linkcnt(fs, n, -1);
+	if (ret == 0) {
+		ext2i_touch(fs, n, Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, n));
+	return ret < 0 ? 0 : n;
+}
+
+static int
+dirent_add(struct ext2 *fs, uint32_t dir_n, const char *name, uint32_t target_n, int flags)
+{
+	size_t len = 0;
+	void *dir;
+	size_t namelen = strlen(name);
+	size_t entlen = DIRENT_SIZE(namelen);
+	dir = ext2i_req_file(fs, Ext2SiteDirent, 0, dir_n, &len, 0);
 	if (!dir) {
 		return -1;
 	}
@@ -56,18 +108,15 @@ ext2_link(struct ext2 *fs, uint32_t dir_n, const char *name, uint32_t target_n,
 	return -1;
 }
 
-uint32_t
-ext2_unlink(struct ext2 *fs, uint32_t dir_n, const char *name)
+/** @return the unlinked inode, without touching its link count */
+static uint32_t
+dirent_remove(struct ext2 *fs, uint32_t dir_n, const char *name)
 {
 	size_t len = 0;
 	void *dir;
 	size_t namelen = strlen(name);
 	size_t entlen = DIRENT_SIZE(namelen);
-	if (!fs->rw) return 0;
-	if ((uint8_t)namelen != namelen) {
-		return 0;
-	}
-	dir = ext2_req_file(fs, dir_n, &len, 0);
+	dir = ext2i_req_file(fs, Ext2SiteDirent, 0, dir_n, &len, 0);
 	if (!dir) {
 		return 0;
 	}
@@ -80,8 +129,6 @@ ext2_unlink(struct ext2 *fs, uint32_t dir_n, const char *name)
 			ent->inode = 0;
 			if (ext2_dropreq(fs, dir, true) < 0) {
 				return 0;
-			} else if (ext2i_change_linkcnt(fs, n, -1) < 0) {
-				return 0;
 			} else {
 				return n;
 			}
@@ -95,12 +142,16 @@ ext2_unlink(struct ext2 *fs, uint32_t dir_n, const char *name)
 static int
 bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type)
 {
-	uint32_t group = gidx / fs->inodes_per_group;
-	uint32_t idx   = gidx % fs->inodes_per_group;
+	struct ext2i_divisor per_group = type == Ext2Inode ? fs->ipg : fs->bpg;
+	uint32_t group = ext2i_div(per_group, gidx);
+	uint32_t idx   = ext2i_mod(per_group, gidx);
+	int ret = 0;
+	pthread_mutex_lock(&fs->group_locks[group]);
 	{
 		struct ext2d_bgd *bgd;
 		bgd = ext2_req_bgdt(fs, group);
 		if (!bgd) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
 			return -1;
 		}
 		if (type == Ext2Inode) {
@@ -109,6 +160,7 @@ bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type)
 			bgd->blocks_free++;
 		}
 		if (ext2_dropreq(fs, bgd, true) < 0) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
 			return -1;
 		}
 	}
@@ -116,6 +168,7 @@ bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type)
 		/* reuses the just cached BGD */
 		uint8_t *bitmap = ext2_req_bitmap(fs, group, type);
 		if (!bitmap) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
 			return -1;
 		}
 		uint32_t byte = idx / 8;
@@ -123,16 +176,21 @@ bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type)
 		if (!(byte < fs->block_size) || (bitmap[byte] & mask) == 0) {
 			// TODO fs potentially FUBAR
 			ext2_dropreq(fs, bitmap, false);
+			pthread_mutex_unlock(&fs->group_locks[group]);
 			return -1;
 		}
 		bitmap[byte] &= ~mask;
 		if (ext2_dropreq(fs, bitmap, true) < 0) {
+			pthread_mutex_unlock(&fs->group_locks[group]);
 			return -1;
 		}
 	}
+	pthread_mutex_unlock(&fs->group_locks[group]);
+	pthread_mutex_lock(&fs->sb_lock);
 	{
 		struct ext2d_superblock *sb = ext2_req_sb(fs);
 		if (!sb) {
+			pthread_mutex_unlock(&fs->sb_lock);
 			return -1;
 		}
 		if (type == Ext2Inode) {
@@ -141,42 +199,140 @@ bitmap_dealloc_auto(struct ext2 *fs, uint32_t gidx, enum ext2_bitmap type)
 			sb->blocks_free++;
 		}
 		if (ext2_dropreq(fs, sb, true) < 0) {
-			return -1;
+			ret = -1;
 		}
 	}
-	return 0;
+	pthread_mutex_unlock(&fs->sb_lock);
+	return ret;
 }
 
+/* Puts the inode on the orphan list. It's kept in the superblock, so if we
+ * crash before ext2_reclaim gets to it, e2fsck will free it instead. */
 static int
-nuke_inode(struct ext2 *fs, uint32_t inode_n)
+orphan_add(struct ext2 *fs, uint32_t inode_n)
 {
-	// the superblock / bgd writes could easily be batched here
-	struct ext2d_inode *inode = NULL;
-
-	// TODO indirect blocks
-	for (int i = 0; i < 12; i++) {
-		if (!inode) {
-			inode = ext2_req_inode(fs, inode_n);
-			if (!inode) return -1;
+	struct ext2d_superblock *sb;
+	struct ext2d_inode *inode;
+	uint32_t next;
+	int ret = -1;
+
+	pthread_mutex_lock(&fs->orphan_lock);
+	/* last_orphan is only ever written with orphan_lock held */
+	sb = ext2_req_sb(fs);
+	if (!sb) goto out;
+	next = sb->last_orphan;
+	ext2_dropreq(fs, sb, false);
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) goto out;
+	inode->dtime = next;
+	if (ext2_dropreq(fs, inode, true) < 0) {
+		goto out;
+	}
+	/* the list must never point to an unlinked inode on disk */
+	if (ext2i_sync_inode(fs, inode_n) < 0) {
+		goto out;
+	}
+
+	pthread_mutex_lock(&fs->sb_lock);
+	sb = ext2_req_sb(fs);
+	if (sb) {
+		sb->last_orphan = inode_n;
+		ret = ext2_dropreq(fs, sb, true);
+	}
+	pthread_mutex_unlock(&fs->sb_lock);
+out:
+	pthread_mutex_unlock(&fs->orphan_lock);
+	return ret;
+}
+
+int
+ext2_reclaim(struct ext2 *fs, uint32_t budget)
+{
+	if (!fs->rw) return -1;
+	for (;;) {
+		uint32_t inode_n, head;
+		int ret;
+		/* Whoever still holds the inode number may be using the orphan, so
+		 * it gets freed under its inode lock. That one comes before
+		 * orphan_lock, so the head is looked at first, and checked again
+		 * once both are held. */
+		pthread_mutex_lock(&fs->orphan_lock);
+		ret = orphan_head(fs, &inode_n);
+		pthread_mutex_unlock(&fs->orphan_lock);
+		if (ret < 0) return -1;
+		if (inode_n == 0) return 0;
+		if (budget == 0) return 1;
+
+		pthread_rwlock_wrlock(ext2i_inode_lock(fs, inode_n));
+		pthread_mutex_lock(&fs->orphan_lock);
+		ret = orphan_head(fs, &head);
+		if (ret == 0 && head == inode_n) {
+			ret = reclaim_locked(fs, inode_n, &budget);
 		}
+		pthread_mutex_unlock(&fs->orphan_lock);
+		pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
+		if (ret != 0) return ret;
+	}
+}
+
+static int
+orphan_head(struct ext2 *fs, uint32_t *inode_n)
+{
+	struct ext2d_superblock *sb = ext2_req_sb(fs);
+	if (!sb) return -1;
+	*inode_n = sb->last_orphan;
+	ext2_dropreq(fs, sb, false);
+	return 0;
+}
 
-		/* If this fails in the middle of this loop, you'll have a valid inode with
-		 * references to dead blocks. This shouldn't result in a data leak, as an inode
-		 * is only to be nuked if there are no more references to it. */
-		uint32_t block = inode->block[i];
-		if (block == 0) continue;
-		ext2_dropreq(fs, inode, false);
-		inode = NULL;
-		if (bitmap_dealloc_auto(fs, block - 1, Ext2Block) < 0) {
+/* Frees the orphan at the head of the list, or only its tail if the budget
+ * doesn't cover all of it. Needs its inode lock and orphan_lock.
+ * @return 0 if it got freed, 1 if the budget ran out, -1 on failure */
+static int
+reclaim_locked(struct ext2 *fs, uint32_t inode_n, uint32_t *budget)
+{
+	struct ext2d_superblock *sb;
+	struct ext2d_inode *inode;
+	uint32_t next;
+	uint64_t blocks;
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return -1;
+	blocks = (inode->size_lower + fs->block_mask) >> fs->block_shift;
+	next = inode->dtime;
+	ext2_dropreq(fs, inode, false);
+
+	if (blocks > *budget) {
+		/* Free the tail. The inode stays valid, so this can be resumed at
+		 * any point. */
+		if (ext2i_truncate(fs, inode_n, (blocks - *budget) * fs->block_size) < 0) {
 			return -1;
 		}
+		return 1;
+	}
+	if (ext2i_truncate(fs, inode_n, 0) < 0) {
+		return -1;
 	}
+	*budget -= blocks > 0 ? blocks : 1;
 
-	if (!inode) {
-		inode = ext2_req_inode(fs, inode_n);
-		if (!inode) return -1;
+	/* Unlink it from the orphan list first - if we crash after that,
+	 * the inode just leaks. */
+	pthread_mutex_lock(&fs->sb_lock);
+	sb = ext2_req_sb(fs);
+	if (!sb) {
+		pthread_mutex_unlock(&fs->sb_lock);
+		return -1;
+	}
+	sb->last_orphan = next;
+	if (ext2_dropreq(fs, sb, true) < 0) {
+		pthread_mutex_unlock(&fs->sb_lock);
+		return -1;
 	}
-	// TODO check linkcnt
+	pthread_mutex_unlock(&fs->sb_lock);
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return -1;
 	inode->dtime = fs->gettime32(fs->dev);
 	if (ext2_dropreq(fs, inode, true) < 0) {
 		return -1;
@@ -205,9 +361,5 @@ ext2i_change_linkcnt(struct ext2 *fs, uint32_t inode_n, int d)
 	if (!gone) {
 		return 0;
 	}
-	if (nuke_inode(fs, inode_n) < 0) {
-		// TODO unlinking and nuking an inode should be two separate things
-		return -1;
-	}
-	return 0;
+	return orphan_add(fs, inode_n);
 }
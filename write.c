@@ -1,113 +1,285 @@
 #include "ext2.h"
-#include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+static int write_locked(struct ext2 *fs, uint32_t inode_n, const void *buf, size_t len, size_t off);
+static int alloc_for_write(struct ext2 *fs, uint32_t inode_n, size_t off, size_t end, size_t size);
+static int zero_block(struct ext2 *fs, uint32_t inode_n, uint32_t block);
+static uint32_t alloc_append(struct ext2 *fs, uint32_t inode_n, uint32_t iblock,
+		uint32_t goal, uint32_t need, uint32_t *got);
+
 int
 ext2_write(struct ext2 *fs, uint32_t inode_n, const void *buf, size_t len, size_t off)
+{
+	int ret;
+	if (!fs->rw) return -1;
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, inode_n));
+	ret = write_locked(fs, inode_n, buf, len, off);
+	if (ret > 0) {
+		ext2i_touch(fs, inode_n, Ext2TouchM | Ext2TouchC);
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
+	return ret;
+}
+
+static int
+write_locked(struct ext2 *fs, uint32_t inode_n, const void *buf, size_t len, size_t off)
 {
 	struct ext2d_inode *inode;
 	uint64_t dev_off, dev_len;
-	if (!fs->rw) return -1;
+	size_t size;
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) {
+		return -1;
+	}
+	size = inode->size_lower;
+	ext2_dropreq(fs, inode, false);
 
-	if (ext2_alloc_space(fs, inode_n, off + len) < 0) {
+	/* only the blocks being written to, anything skipped stays a hole */
+	if (alloc_for_write(fs, inode_n, off, off + len, size) < 0) {
 		return -1;
 	}
 
 	/* do it for real */
 	for (size_t pos = 0; pos < len; ) {
 		void *p;
-		if (ext2_inode_ondisk(fs, inode_n, off + pos, &dev_off, &dev_len) < 0) {
+		if (ext2_inode_ondisk(fs, inode_n, off + pos, &dev_off, &dev_len) != 0) {
 			return -1;
 		}
 		if (dev_len > len - pos) {
 			dev_len = len - pos;
 		}
-		p = fs->req(fs->dev, dev_len, dev_off);
+		p = ext2i_reqh(fs, Ext2SiteFile, pos + dev_len < len ? E2HintSeq : 0,
+			inode_n, dev_len, dev_off);
 		if (!p) return -1;
 		/* This memcpy is certainly not optimal, but hopefully it's drowned out
 		 * by the IO cost. */
 		memcpy(p, buf + pos, dev_len);
-		if (fs->drop(fs->dev, p, true) < 0) {
+		if (ext2i_drop(fs, p, true) < 0) {
 			return -1;
 		}
 		pos += dev_len;
 	}
 
+	if (size < len + off) {
+		inode = ext2_req_inode(fs, inode_n);
+		if (!inode) {
+			return -1;
+		}
+		if (inode->size_lower < len + off) {
+			inode->size_lower = len + off;
+		}
+		if (ext2_dropreq(fs, inode, true) < 0) {
+			return -1;
+		}
+	}
+
+	return len;
+}
+
+/* Blocks filling holes within the size get zeroed, so if the write fails
+ * halfway, they can't expose whatever they held before. Past the size, nothing
+ * can read them until the size is set, so only the partial ones need it. */
+static int
+alloc_for_write(struct ext2 *fs, uint32_t inode_n, size_t off, size_t end, size_t size)
+{
+	size_t size_up = (size + fs->block_mask) & ~(size_t)fs->block_mask;
+	unsigned append = end > size ? Ext2AllocAppend : 0;
+	if (off < size_up && ext2i_alloc_range(fs, inode_n, off,
+			end < size_up ? end : size_up, end <= size_up ? append : 0) < 0) {
+		return -1;
+	}
+	if (end > size_up && ext2i_alloc_range(fs, inode_n,
+			off > size_up ? off : size_up, end, Ext2AllocFill | append) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+void *
+ext2_req_file_write(struct ext2 *fs, uint32_t inode_n, size_t *len, size_t off)
+{
+	struct ext2d_inode *inode;
+	size_t dev_off, dev_len, size;
+	size_t left = fs->block_size - (off & fs->block_mask);
+
+	if (!fs->rw) return NULL;
+	if (*len == 0 || *len > left) {
+		*len = left;
+	}
+	if ((uint32_t)(off + *len) != off + *len) return NULL;
+
+	inode = ext2_req_inode(fs, inode_n);
+	if (!inode) return NULL;
+	size = inode->size_lower;
+	ext2_dropreq(fs, inode, false);
+
+	if (alloc_for_write(fs, inode_n, off, off + *len, size) < 0) {
+		return NULL;
+	}
+	if (ext2_inode_ondisk(fs, inode_n, off, &dev_off, &dev_len) != 0) {
+		return NULL;
+	}
+	return ext2i_reqh(fs, Ext2SiteFile, 0, inode_n, *len, dev_off);
+}
+
+int
+ext2_drop_file_write(struct ext2 *fs, uint32_t inode_n, void *ptr, size_t off, size_t len)
+{
+	struct ext2d_inode *inode;
+	bool grow;
+	int ret = ext2_dropreq(fs, ptr, true);
 	inode = ext2_req_inode(fs, inode_n);
 	if (!inode) {
 		return -1;
 	}
-	if (inode->size_lower < len + off) {
-		inode->size_lower = len + off;
+	grow = inode->size_lower < off + len;
+	if (grow) {
+		inode->size_lower = off + len;
 	}
-	if (fs->drop(fs->dev, inode, true) < 0) {
-		return -1;
+	if (ext2_dropreq(fs, inode, grow) < 0) {
+		ret = -1;
 	}
+	ext2i_touch(fs, inode_n, Ext2TouchM | Ext2TouchC);
+	return ret;
+}
 
-	return len;
+uint32_t
+ext2i_bitmap_alloc_run(uint8_t *bitmap, size_t buflen, size_t bitlen,
+		uint32_t start, uint32_t want, uint32_t *target)
+{
+	size_t bit = start;
+	uint32_t got = 0;
+	if (bitlen > buflen * 8) {
+		bitlen = buflen * 8;
+	}
+	while (bit < bitlen) {
+		if (bit % 8 == 0 && bitmap[bit / 8] == 0xFF) {
+			bit += 8;
+			continue;
+		}
+		if ((bitmap[bit / 8] & (1 << bit % 8)) == 0) break;
+		bit++;
+	}
+	if (!(bit < bitlen)) {
+		return 0;
+	}
+	*target = bit;
+	while (got < want && bit < bitlen && (bitmap[bit / 8] & (1 << bit % 8)) == 0) {
+		bitmap[bit / 8] |= 1 << bit % 8;
+		bit++;
+		got++;
+	}
+	return got;
 }
 
 int
 ext2i_bitmap_alloc(uint8_t *bitmap, size_t buflen, size_t bitlen, uint32_t *target)
 {
-	for (size_t byte = 0; byte < buflen && byte < bitlen / 8; byte++) {
-		if (bitmap[byte] == 0xFF) continue;
-		for (size_t bit = 0; bit < 7 && byte * 8 + bit < bitlen; bit++) {
-			if ((bitmap[byte] & (1 << bit)) == 0) {
-				bitmap[byte] |= 1 << bit;
-				*target = byte * 8 + bit;
-				return 0;
+	return ext2i_bitmap_alloc_run(bitmap, buflen, bitlen, 0, 1, target) == 1 ? 0 : -1;
+}
+
+/* Allocates up to want consecutive bits within a single group, looking at
+ * start first and then at the whole group.
+ * @return the amount allocated, 0 if the group is full or on failure */
+static uint32_t
+group_alloc(struct ext2 *fs, uint32_t group, enum ext2_bitmap type,
+		uint32_t start, uint32_t want, uint32_t *idx)
+{
+	size_t bitlen = type == Ext2Inode ? fs->inodes_per_group : fs->blocks_per_group;
+	struct ext2d_bgd *bgd;
+	uint8_t *bitmap;
+	uint32_t avail;
+	uint32_t got = 0;
+
+	pthread_mutex_lock(&fs->group_locks[group]);
+	bgd = ext2_req_bgdt(fs, group);
+	if (!bgd) goto out;
+	avail = type == Ext2Inode ? bgd->inodes_free : bgd->blocks_free;
+	ext2_dropreq(fs, bgd, false);
+	if (avail == 0) goto out;
+	if (want > avail) {
+		want = avail;
+	}
+
+	bitmap = ext2_req_bitmap(fs, group, type);
+	if (!bitmap) goto out;
+	got = ext2i_bitmap_alloc_run(bitmap, fs->block_size, bitlen, start, want, idx);
+	if (got == 0 && start > 0) {
+		got = ext2i_bitmap_alloc_run(bitmap, fs->block_size, bitlen, 0, want, idx);
+	}
+	if (ext2_dropreq(fs, bitmap, got > 0) < 0 || got == 0) {
+		got = 0;
+		goto out;
+	}
+
+	bgd = ext2_req_bgdt(fs, group);
+	if (!bgd) {
+		/* The counts weren't touched yet, so giving the bits back undoes
+		 * the allocation. */
+		bitmap = ext2_req_bitmap(fs, group, type);
+		if (bitmap) {
+			for (uint32_t i = *idx; i < *idx + got; i++) {
+				bitmap[i / 8] &= ~(1 << i % 8);
 			}
+			ext2_dropreq(fs, bitmap, true);
 		}
+		got = 0;
+		goto out;
 	}
-	return -1;
+	if (type == Ext2Inode) {
+		bgd->inodes_free -= got;
+	} else {
+		bgd->blocks_free -= got;
+	}
+	if (ext2_dropreq(fs, bgd, true) < 0) {
+		got = 0;
+	}
+out:
+	pthread_mutex_unlock(&fs->group_locks[group]);
+	return got;
+}
+
+static int
+sb_take(struct ext2 *fs, enum ext2_bitmap type, uint32_t amt)
+{
+	struct ext2d_superblock *sb;
+	int ret;
+	pthread_mutex_lock(&fs->sb_lock);
+	sb = ext2_req_sb(fs);
+	if (!sb) {
+		pthread_mutex_unlock(&fs->sb_lock);
+		return -1;
+	}
+	if (type == Ext2Inode) {
+		sb->inodes_free -= amt;
+	} else {
+		sb->blocks_free -= amt;
+	}
+	ret = ext2_dropreq(fs, sb, true);
+	pthread_mutex_unlock(&fs->sb_lock);
+	return ret;
 }
 
 uint32_t
 ext2_alloc_inode(struct ext2 *fs, uint16_t perms)
 {
-	uint32_t inode_n;
-	uint32_t group = 0;
+	uint32_t inode_n = 0;
 	uint32_t idx = 0;
 	struct ext2d_inode *inode;
 	if (!fs->rw) return 0;
-	{
-		uint8_t *ib = ext2_req_bitmap(fs, group, Ext2Inode);
-		if (!ib) {
-			return 0;
-		}
-		if (ext2i_bitmap_alloc(ib, fs->block_size, fs->inodes_per_group, &idx) < 0) {
-			ext2_dropreq(fs, ib, false);
-			return 0;
+	for (uint32_t group = 0; group < fs->groups && inode_n == 0; group++) {
+		if (group_alloc(fs, group, Ext2Inode, 0, 1, &idx) == 1) {
+			inode_n = group * fs->inodes_per_group + idx + 1;
 		}
-		if (ext2_dropreq(fs, ib, true) < 0) {
-			return 0;
-		}
-		inode_n = idx+1;
 	}
-	{
-		struct ext2d_bgd *bgd;
-		bgd = ext2_req_bgdt(fs, group);
-		if (!bgd) {
-			return -1;
-		}
-		bgd->inodes_free--;
-		if (ext2_dropreq(fs, bgd, true) < 0) {
-			return -1;
-		}
+	if (inode_n == 0) {
+		return 0;
 	}
-	{
-		struct ext2d_superblock *sb;
-		sb = ext2_req_sb(fs);
-		if (!sb) {
-			return -1;
-		}
-		sb->inodes_free--;
-		if (ext2_dropreq(fs, sb, true) < 0) {
-			return -1;
-		}
+	if (sb_take(fs, Ext2Inode, 1) < 0) {
+		return 0;
 	}
 	inode = ext2_req_inode(fs, inode_n);
 	if (!inode) {
@@ -116,6 +288,7 @@ ext2_alloc_inode(struct ext2 *fs, uint16_t perms)
 	memset(inode, 0, sizeof *inode);
 	inode->perms = perms;
 	inode->ctime = fs->gettime32(fs->dev);
+	inode->atime = inode->mtime = inode->ctime;
 	if (ext2_dropreq(fs, inode, true) < 0) {
 		return 0;
 	}
@@ -125,114 +298,228 @@ ext2_alloc_inode(struct ext2 *fs, uint16_t perms)
 uint32_t
 ext2_alloc_block(struct ext2 *fs)
 {
-	uint32_t group = 0;
-	uint32_t idx = 0;
-	uint32_t block;
-	{
-		uint8_t *bitmap = ext2_req_bitmap(fs, group, Ext2Block);
-		if (!bitmap) {
-			return 0;
-		}
-		if (ext2i_bitmap_alloc(bitmap, fs->block_size, fs->blocks_per_group, &idx) < 0) {
-			ext2_dropreq(fs, bitmap, false);
-			return 0;
-		}
-		if (ext2_dropreq(fs, bitmap, true) < 0) {
-			return 0;
-		}
-		block = idx+1;
+	uint32_t got;
+	return ext2_alloc_blocks(fs, 0, 1, &got);
+}
+
+uint32_t
+ext2_alloc_blocks(struct ext2 *fs, uint32_t goal, uint32_t want, uint32_t *got)
+{
+	uint32_t block = ext2i_alloc_blocks(fs, goal, want, got);
+	if (block == 0) {
+		return 0;
 	}
-	{
-		struct ext2d_bgd *bgd;
-		bgd = ext2_req_bgdt(fs, group);
-		if (!bgd) {
+	for (uint32_t i = 0; i < *got; i++) {
+		if (zero_block(fs, 0, block + i) < 0) {
+			ext2i_free_blocks(fs, block, *got);
+			*got = 0;
 			return 0;
 		}
-		bgd->blocks_free--;
-		if (ext2_dropreq(fs, bgd, true) < 0) {
-			return 0;
+	}
+	return block;
+}
+
+uint32_t
+ext2i_alloc_blocks(struct ext2 *fs, uint32_t goal, uint32_t want, uint32_t *got)
+{
+	uint32_t group = 0, start = 0;
+	uint32_t idx = 0;
+	uint32_t block = 0;
+	*got = 0;
+	if (!fs->rw || want == 0) return 0;
+	if (goal >= fs->first_data_block) {
+		group = ext2i_div(fs->bpg, goal - fs->first_data_block);
+		start = ext2i_mod(fs->bpg, goal - fs->first_data_block);
+		if (!(group < fs->groups)) {
+			group = start = 0;
 		}
 	}
-	{
-		struct ext2d_superblock *sb;
-		sb = ext2_req_sb(fs);
-		if (!sb) {
+	for (int retry = 0; retry < 2 && *got == 0; retry++) {
+		/* The only space left might be sitting in reservation windows,
+		 * which are marked as used. */
+		if (retry > 0 && ext2i_resv_release_all(fs) < 0) {
 			return 0;
 		}
-		sb->blocks_free--;
-		if (ext2_dropreq(fs, sb, true) < 0) {
-			return 0;
+		for (uint32_t i = 0; i < fs->groups && *got == 0; i++) {
+			uint32_t g = (group + i) % fs->groups;
+			*got = group_alloc(fs, g, Ext2Block, i == 0 ? start : 0, want, &idx);
+			block = g * fs->blocks_per_group + idx + fs->first_data_block;
 		}
 	}
-	char *b = fs->req(fs->dev, fs->block_size, block * fs->block_size);
-	if (!b) {
+	if (*got == 0) {
 		return 0;
 	}
+	if (sb_take(fs, Ext2Block, *got) < 0) {
+		*got = 0;
+		return 0;
+	}
+	return block;
+}
+
+static int
+zero_block(struct ext2 *fs, uint32_t inode_n, uint32_t block)
+{
+	char *b = ext2i_req(fs, Ext2SiteAlloc, inode_n, fs->block_size, (uint64_t)block * fs->block_size);
+	if (!b) {
+		return -1;
+	}
 	memset(b, 0, fs->block_size);
-	if (ext2_dropreq(fs, b, true) < 0) {
+	return ext2_dropreq(fs, b, true);
+}
+
+/* Allocates blocks for the end of a growing file, through its reservation
+ * window (see resv.c). When the window runs out, a new one gets allocated
+ * together with the needed blocks, as a single run. */
+static uint32_t
+alloc_append(struct ext2 *fs, uint32_t inode_n, uint32_t iblock,
+		uint32_t goal, uint32_t need, uint32_t *got)
+{
+	uint32_t block, win;
+	block = ext2i_resv_take(fs, inode_n, iblock, need, got);
+	if (block != 0) {
+		return block;
+	}
+	win = ext2i_resv_window(fs, inode_n);
+	block = ext2i_alloc_blocks(fs, goal, need + win, got);
+	if (block == 0) {
 		return 0;
 	}
+	if (*got > need) {
+		if (ext2i_resv_put(fs, inode_n, iblock + need, block + need, *got - need, win) < 0) {
+			*got = 0;
+			return 0;
+		}
+		*got = need;
+	}
 	return block;
 }
 
+int
+ext2_fallocate(struct ext2 *fs, uint32_t inode_n, size_t off, size_t len)
+{
+	struct ext2d_inode *inode;
+	int ret;
+	if (!fs->rw) return -1;
+	if ((uint32_t)(off + len) != off + len) return -1;
+	pthread_rwlock_wrlock(ext2i_inode_lock(fs, inode_n));
+	ret = ext2i_alloc_range(fs, inode_n, off, off + len, 0);
+	if (ret == 0) {
+		inode = ext2_req_inode(fs, inode_n);
+		if (!inode) {
+			ret = -1;
+		} else {
+			if (inode->size_lower < off + len) {
+				inode->size_lower = off + len;
+			}
+			ret = ext2_dropreq(fs, inode, true);
+		}
+	}
+	pthread_rwlock_unlock(ext2i_inode_lock(fs, inode_n));
+	return ret;
+}
+
 int
 ext2_alloc_space(struct ext2 *fs, uint32_t inode_n, size_t len)
 {
-	bool dirty = false;
-	bool err = false;
-	if (!fs->rw) return 0;
+	return ext2i_alloc_range(fs, inode_n, 0, len, 0);
+}
 
-	uint32_t *iblocks = NULL;
-	size_t iblocks_off = 0;
-	size_t iblocks_len = 0;
+int
+ext2i_alloc_range(struct ext2 *fs, uint32_t inode_n, size_t off, size_t end, unsigned flags)
+{
+	uint64_t iblock = off >> fs->block_shift;
+	uint64_t iend = (end + fs->block_mask) >> fs->block_shift;
+	uint32_t goal = 0;
 	uint32_t allocated = 0;
+	int ret = 0;
+	if (!fs->rw) return 0;
+
+	/* continue right after the block preceding the range */
+	if (iblock > 0) {
+		size_t len;
+		uint32_t *prev = ext2_req_blockmap(fs, inode_n, &len, iblock - 1, false);
+		if (prev) {
+			if (*prev != 0) {
+				goal = *prev + 1;
+			}
+			ext2_dropreq(fs, prev, false);
+		}
+	}
 
-	/* don't break in the middle of the block,
-	 * or the inode will be in an inconsistent state */
-	for (uint64_t iblock = 0; iblock * fs->block_size < len; iblock++) {
-		uint64_t dblock; /* disk block (inode block) */
-		size_t iblocks_pos = iblock - iblocks_off;
-		assert(iblocks_off <= iblock);
+	/* Every hole gets filled with as few runs as possible, the blockmap is
+	 * only written once a whole run is allocated, so the inode never points
+	 * at unallocated blocks. */
+	while (iblock < iend) {
+		uint32_t *iblocks;
+		size_t iblocks_len;
+		size_t pos, need;
+		uint32_t dblock, got;
 
-		if (iblocks && !(iblocks_pos < iblocks_len)) {
-			ext2_dropreq(fs, iblocks, dirty);
-			iblocks = NULL;
+		iblocks = ext2_req_blockmap(fs, inode_n, &iblocks_len, iblock, true);
+		if (!iblocks) {
+			ret = -1;
+			break;
+		}
+		for (pos = 0; pos < iblocks_len && iblock + pos < iend && iblocks[pos] != 0; pos++) {
+			goal = iblocks[pos] + 1;
 		}
-		if (iblocks == NULL) {
-			iblocks_off = iblock;
-			iblocks_pos = 0;
-			iblocks = ext2_req_blockmap(fs, inode_n, &iblocks_len, iblocks_off, true);
-			dirty = false;
-			if (iblocks == NULL) {
-				err = true;
+		for (need = 0; pos + need < iblocks_len && iblock + pos + need < iend
+				&& iblocks[pos + need] == 0; need++);
+		ext2_dropreq(fs, iblocks, false);
+		iblock += pos;
+		if (need == 0) {
+			if (pos == 0) {
+				ret = -1;
 				break;
 			}
+			continue;
 		}
 
-		dblock = iblocks[iblocks_pos];
-		if (dblock != 0) continue;
-		if (ext2_dropreq(fs, iblocks, dirty) < 0) {
-			return -1;
+		/* only one request may be active, so the map has to be requested
+		 * again after allocating */
+		if ((flags & Ext2AllocAppend) && iblock + need == iend) {
+			dblock = alloc_append(fs, inode_n, iblock, goal, need, &got);
+		} else {
+			dblock = ext2i_alloc_blocks(fs, goal, need, &got);
 		}
-		iblocks = NULL;
-		dirty = false;
-
-		dblock = ext2_alloc_block(fs);
-		if (dblock == 0) return -1;
-
-		iblocks_off = iblock;
-		iblocks_pos = 0;
-		iblocks = ext2_req_blockmap(fs, inode_n, &iblocks_len, iblocks_off, true);
-		if (iblocks == NULL) {
-			err = true;
+		if (dblock == 0) {
+			ret = -1;
 			break;
 		}
-		iblocks[iblocks_pos] = dblock;
-		dirty = true;
-		allocated++;
-	}
-	if (iblocks && ext2_dropreq(fs, iblocks, dirty) < 0) {
-		return -1;
+		/* Zeroed before they're mapped, so the file never exposes old
+		 * data. Blocks the caller overwrites completely are skipped. */
+		for (uint32_t i = 0; i < got; i++) {
+			uint64_t b = iblock + i;
+			if ((flags & Ext2AllocFill) && b * fs->block_size >= off
+					&& (b + 1) * fs->block_size <= end) {
+				continue;
+			}
+			if (zero_block(fs, inode_n, dblock + i) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (ret == 0) {
+			iblocks = ext2_req_blockmap(fs, inode_n, &iblocks_len, iblock, true);
+			if (!iblocks) {
+				ret = -1;
+			}
+		}
+		if (ret < 0) {
+			/* not mapped yet, so nothing else knows about them */
+			ext2i_free_blocks(fs, dblock, got);
+			break;
+		}
+		for (uint32_t i = 0; i < got; i++) {
+			iblocks[i] = dblock + i;
+		}
+		if (ext2_dropreq(fs, iblocks, true) < 0) {
+			ret = -1;
+			break;
+		}
+		allocated += got;
+		iblock += got;
+		goal = dblock + got;
 	}
 
 	struct ext2d_inode *inode;
@@ -242,17 +529,5 @@ ext2_alloc_space(struct ext2 *fs, uint32_t inode_n, size_t len)
 	if (ext2_dropreq(fs, inode, true) < 0) {
 		return -1;
 	}
-
-	if (err) {
-		return -1;
-	}
-
-	/* test run, see if we can access all the space */
-	// TODO remove this hack
-	for (size_t pos = 0; pos < len; ) {
-		size_t dev_off, dev_len;
-		assert(ext2_inode_ondisk(fs, inode_n, pos, &dev_off, &dev_len) >= 0);
-		pos += dev_len;
-	}
-	return 0;
+	return ret;
 }